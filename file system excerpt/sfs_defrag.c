@@ -0,0 +1,98 @@
+/* sfs-defrag: defragment files on a mounted sfs image.
+   Walks the given files and directories and asks the file system, through
+   SFS_IOC_DEFRAG, to relink each chain into contiguous blocks. Every call
+   moves a bounded number of blocks and the tool sleeps between calls, so
+   foreground users of the mount keep their latency.
+
+   usage: sfs-defrag [-r blocks_per_second] [-s blocks_per_call] path...
+*/
+
+#define _XOPEN_SOURCE 700
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include "sfs_ioctl.h"
+
+static unsigned rate = 2048;
+static unsigned step = 256;
+static unsigned long long total_files, total_moved;
+static int failed;
+
+// sleep for the time the given number of blocks may take at the set rate
+static void pace(unsigned blocks) {
+    if (rate == 0 || blocks == 0) return;
+    unsigned long long ns = (unsigned long long)blocks * 1000000000ull / rate;
+    struct timespec ts = { .tv_sec = ns / 1000000000ull, .tv_nsec = ns % 1000000000ull };
+    while (nanosleep(&ts, &ts) < 0 && errno == EINTR) {
+    }
+}
+
+static int defrag_one(const char *path) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "sfs-defrag: %s: %s\n", path, strerror(errno));
+        failed = 1;
+        return 0;
+    }
+
+    struct sfs_defrag_req req = { .start = 0, .max_blocks = step };
+    unsigned long long moved = 0;
+    do {
+        if (ioctl(fd, SFS_IOC_DEFRAG, &req) < 0) {
+            fprintf(stderr, "sfs-defrag: %s: %s\n", path, strerror(errno));
+            failed = 1;
+            break;
+        }
+        moved += req.moved;
+        pace(req.moved);
+        req.start = req.next;
+    } while (req.next != 0);
+
+    close(fd);
+    total_files++;
+    total_moved += moved;
+    if (moved > 0) printf("%s: %llu blocks moved\n", path, moved);
+    return 0;
+}
+
+static int visit(const char *path, const struct stat *st, int type, struct FTW *ftw) {
+    (void)st;
+    (void)ftw;
+    if (type == FTW_F) defrag_one(path);
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    int opt;
+    while ((opt = getopt(argc, argv, "r:s:")) != -1) {
+        switch (opt) {
+        case 'r': rate = (unsigned)strtoul(optarg, NULL, 0); break;
+        case 's': step = (unsigned)strtoul(optarg, NULL, 0); break;
+        default:
+            fprintf(stderr, "usage: %s [-r blocks_per_second] [-s blocks_per_call] path...\n",
+                    argv[0]);
+            return 2;
+        }
+    }
+    if (optind == argc) {
+        fprintf(stderr, "usage: %s [-r blocks_per_second] [-s blocks_per_call] path...\n",
+                argv[0]);
+        return 2;
+    }
+
+    for (int i = optind; i < argc; i++) {
+        if (nftw(argv[i], visit, 16, FTW_PHYS | FTW_MOUNT) < 0) {
+            fprintf(stderr, "sfs-defrag: %s: %s\n", argv[i], strerror(errno));
+            failed = 1;
+        }
+    }
+
+    printf("%llu files checked, %llu blocks moved\n", total_files, total_moved);
+    return failed;
+}
@@ -5,13 +5,254 @@
    This excerpt compiles when linked against the original headers and disk layer.
 */
 
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE // fallocate
+#endif
+
 #include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/statvfs.h>
 #include <time.h>
 #include <unistd.h>
 #include "sfs.h"
 #include "diskio.h"
+#include "sfs_format.h"
+#include "sfs_ioctl.h"
+
+// format extensions found at mount, see sfs_format.h. super holds the live
+// free list head; the counters in it are only refreshed when it is written
+static struct sfs_super super;
+static int has_super;
+
+static int use_packdir(void) {
+    return has_super && (super.features & SFS_FEAT_PACKDIR);
+}
+
+// whether an entry array, or the entry at an offset, is in packed form. only
+// subdirectories are, and their arrays live in the data region
+static int is_packed(unsigned off) {
+    return off >= SFS_DATA_OFF && use_packdir();
+}
+
+// walks a directory's entry array, free slots and records included. arrays
+// that fit the buffer, every subdirectory's, are read with one disk read
+struct dir_scan {
+    unsigned dir_off, end, pos;
+    int buffered;
+    char area[SFS_DIRREC_AREA];
+};
+
+static void dir_scan_start(struct dir_scan *scan, unsigned dir_off, unsigned num_entries) {
+    scan->dir_off = dir_off;
+    scan->pos = 0;
+    scan->end = num_entries == 0 ? 0 :
+                is_packed(dir_off) ? SFS_DIRREC_AREA : num_entries * sizeof(struct sfs_entry);
+    scan->buffered = scan->end <= sizeof(scan->area);
+    if (scan->buffered && scan->end > 0) disk_read(scan->area, scan->end, dir_off);
+}
+
+// decode a packed record, returns its length. a damaged record swallows the
+// rest of the array as free space
+static unsigned decode_rec(const char *p, unsigned room, struct sfs_entry *entry) {
+    struct sfs_dirrec rec;
+    memset(entry, 0, sizeof(*entry));
+    entry->first_block = SFS_BLOCKIDX_EMPTY;
+    if (room < SFS_DIRREC_LEN(0)) return room;
+    memcpy(&rec, p, offsetof(struct sfs_dirrec, name));
+    if (rec.rec_len < SFS_DIRREC_LEN(0) || rec.rec_len > room || rec.rec_len % SFS_DIRREC_ALIGN)
+        return room;
+    if (rec.name_len > 0 && rec.name_len < SFS_FILENAME_MAX &&
+        SFS_DIRREC_LEN(rec.name_len) <= rec.rec_len) {
+        memcpy(entry->filename, p + offsetof(struct sfs_dirrec, name), rec.name_len);
+        entry->first_block = rec.first_block;
+        entry->size = rec.size;
+    }
+    return rec.rec_len;
+}
+
+// next entry of the array and its offset, 0 once the array is done
+static int dir_scan_next(struct dir_scan *scan, struct sfs_entry *entry, unsigned *entry_off) {
+    if (scan->pos >= scan->end) return 0;
+    *entry_off = scan->dir_off + scan->pos;
+    if (is_packed(scan->dir_off)) {
+        scan->pos += decode_rec(scan->area + scan->pos, scan->end - scan->pos, entry);
+    } else {
+        if (scan->buffered) memcpy(entry, scan->area + scan->pos, sizeof(*entry));
+        else disk_read(entry, sizeof(*entry), *entry_off);
+        scan->pos += sizeof(*entry);
+    }
+    return 1;
+}
+
+// lookup cache: paths resolved by get_entry, with their entry and its
+// offset, so getattr can answer without fs_lock. it is only changed under
+// fs_lock; each slot carries a sequence counter that is odd while a writer
+// is in it, and a reader that sees it change in between falls back to the
+// locked path. a second table maps entry offsets to slots, so writing back an
+// entry updates its cached copy and clearing one drops it
+#define SFS_LOOKUP_SLOTS 1024
+#define SFS_LOOKUP_PATH 128
+
+struct lookup_slot {
+    unsigned seq;
+    unsigned entry_off;         // 0 for an empty slot
+    struct sfs_entry entry;
+    char path[SFS_LOOKUP_PATH];
+};
+
+static struct lookup_slot lookup_cache[SFS_LOOKUP_SLOTS];
+static unsigned lookup_by_off[SFS_LOOKUP_SLOTS]; // slot index + 1, 0 for none
+
+static unsigned lookup_hash(const char *path) {
+    uint32_t hash = 2166136261u;
+    for (const char *p = path; *p; p++) hash = (hash ^ (unsigned char)*p) * 16777619u;
+    return hash % SFS_LOOKUP_SLOTS;
+}
+
+static unsigned lookup_off_hash(unsigned entry_off) {
+    return (entry_off * 2654435761u >> 16) % SFS_LOOKUP_SLOTS;
+}
+
+static void slot_begin(struct lookup_slot *slot) {
+    __atomic_store_n(&slot->seq, slot->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static void slot_end(struct lookup_slot *slot) {
+    __atomic_store_n(&slot->seq, slot->seq + 1, __ATOMIC_RELEASE);
+}
+
+static void lookup_clear(struct lookup_slot *slot) {
+    slot_begin(slot);
+    slot->entry_off = 0;
+    slot_end(slot);
+}
+
+// remember a resolved path, caller holds fs_lock
+static void lookup_insert(const char *path, const struct sfs_entry *entry, unsigned entry_off) {
+    size_t len = strlen(path);
+    if (len >= SFS_LOOKUP_PATH) return;
+    unsigned index = lookup_hash(path);
+    struct lookup_slot *slot = &lookup_cache[index];
+
+    // the slot's old entry and the offset's old slot both lose their mapping
+    if (slot->entry_off != 0 && lookup_by_off[lookup_off_hash(slot->entry_off)] == index + 1)
+        lookup_by_off[lookup_off_hash(slot->entry_off)] = 0;
+    unsigned *by_off = &lookup_by_off[lookup_off_hash(entry_off)];
+    if (*by_off != 0 && *by_off != index + 1) lookup_clear(&lookup_cache[*by_off - 1]);
+    *by_off = index + 1;
+
+    slot_begin(slot);
+    slot->entry_off = entry_off;
+    slot->entry = *entry;
+    memcpy(slot->path, path, len + 1);
+    slot_end(slot);
+}
+
+static struct lookup_slot *lookup_slot_of(unsigned entry_off) {
+    unsigned by_off = lookup_by_off[lookup_off_hash(entry_off)];
+    if (by_off == 0 || lookup_cache[by_off - 1].entry_off != entry_off) return NULL;
+    return &lookup_cache[by_off - 1];
+}
+
+// an entry was written back, caller holds fs_lock
+static void lookup_update(const struct sfs_entry *entry, unsigned entry_off) {
+    struct lookup_slot *slot = lookup_slot_of(entry_off);
+    if (!slot) return;
+    slot_begin(slot);
+    slot->entry.first_block = entry->first_block;
+    slot->entry.size = entry->size;
+    slot_end(slot);
+}
+
+// an entry was cleared, caller holds fs_lock
+static void lookup_drop(unsigned entry_off) {
+    struct lookup_slot *slot = lookup_slot_of(entry_off);
+    if (slot) lookup_clear(slot);
+}
+
+// lock free lookup, 0 when the path is not cached or a writer got in the way
+static int lookup_cached(const char *path, struct sfs_entry *entry) {
+    size_t len = strlen(path);
+    if (len >= SFS_LOOKUP_PATH) return 0;
+    struct lookup_slot *slot = &lookup_cache[lookup_hash(path)];
+
+    unsigned seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+    if (seq & 1) return 0;
+    char cached[SFS_LOOKUP_PATH];
+    memcpy(cached, slot->path, sizeof(cached));
+    struct sfs_entry copy = slot->entry;
+    unsigned entry_off = slot->entry_off;
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) != seq) return 0;
+
+    if (entry_off == 0 || memcmp(cached, path, len + 1) != 0) return 0;
+    *entry = copy;
+    return 1;
+}
+
+// open generations: a direct mapped table from entry offsets to a counter
+// that moves whenever the file's data or size changes or its entry goes away,
+// next to the counter's value at the last open. an open that finds them equal
+// lets the kernel keep the pages it cached. an entry without a slot, never
+// opened or pushed out by another, starts over with an empty cache. only used
+// under fs_lock
+struct gen_slot {
+    unsigned entry_off;         // 0 for an empty slot
+    unsigned gen;
+    unsigned opened;
+};
+
+static struct gen_slot gen_table[SFS_LOOKUP_SLOTS];
+
+// the file at entry_off changed or was removed
+static void gen_bump(unsigned entry_off) {
+    struct gen_slot *slot = &gen_table[lookup_off_hash(entry_off)];
+    if (slot->entry_off == entry_off) slot->gen++;
+}
+
+// record an open, 1 when the file is unchanged since the one before
+static int gen_open(unsigned entry_off) {
+    struct gen_slot *slot = &gen_table[lookup_off_hash(entry_off)];
+    if (slot->entry_off == entry_off && slot->opened == slot->gen) return 1;
+    if (slot->entry_off != entry_off) {
+        slot->entry_off = entry_off;
+        slot->gen = 0;
+    }
+    slot->opened = slot->gen;
+    return 0;
+}
+
+// write back the size and first block of an entry, its name stays as it is
+static void put_entry(const struct sfs_entry *entry, unsigned entry_off) {
+    if (is_packed(entry_off)) {
+        struct sfs_dirrec rec = { .size = entry->size, .first_block = entry->first_block };
+        disk_write(&rec, offsetof(struct sfs_dirrec, rec_len), entry_off);
+    } else {
+        disk_write(entry, sizeof(*entry), entry_off);
+    }
+    lookup_update(entry, entry_off);
+}
+
+static int use_smallfile(void) {
+    return has_super && (super.features & SFS_FEAT_SMALLFILE);
+}
+
+static int is_packed_file(const struct sfs_entry *entry) {
+    return use_smallfile() && !(entry->size & SFS_DIRECTORY) && (entry->size & SFS_PACKED);
+}
+
+static uint32_t file_size_of(const struct sfs_entry *entry) {
+    return is_packed_file(entry) ? SFS_PACK_LEN(entry->size) : entry->size & SFS_SIZEMASK;
+}
+
+// largest file size, with small file packing the packed flag takes a bit
+static uint32_t max_file_size(void) {
+    return use_smallfile() ? SFS_SIZEMASK & ~SFS_PACKED : SFS_SIZEMASK;
+}
 
 // helper that walks a path and returns the directory entry and its offset
 static int get_entry(const char *path, struct sfs_entry *ret_entry, unsigned *ret_entry_off) {
@@ -35,24 +276,28 @@ static int get_entry(const char *path, struct sfs_entry *ret_entry, unsigned *re
     unsigned current_off = SFS_ROOTDIR_OFF;
     unsigned entries_per_dir = SFS_ROOTDIR_NENTRIES;
     struct sfs_entry current_entry;
+    unsigned current_entry_off;
+    struct dir_scan scan;
 
     while (component) {
         int found = 0;
 
         // scan the current directory entries
-        for (unsigned i = 0; i < entries_per_dir; i++) {
-            disk_read(&current_entry, sizeof(current_entry),
-                      current_off + i * sizeof(struct sfs_entry));
-
+        dir_scan_start(&scan, current_off, entries_per_dir);
+        while (dir_scan_next(&scan, &current_entry, &current_entry_off)) {
             if (strlen(current_entry.filename) > 0 &&
                 strcmp(current_entry.filename, component) == 0) {
                 found = 1;
                 *ret_entry = current_entry;
-                *ret_entry_off = current_off + i * sizeof(struct sfs_entry);
+                *ret_entry_off = current_entry_off;
 
                 // move to next component if any
                 component = strtok(NULL, "/");
-                if (!component) { free(path_copy); return 0; }
+                if (!component) {
+                    free(path_copy);
+                    lookup_insert(path, ret_entry, *ret_entry_off);
+                    return 0;
+                }
 
                 // must be a directory if there are more components
                 if (!(current_entry.size & SFS_DIRECTORY)) {
@@ -60,6 +305,12 @@ static int get_entry(const char *path, struct sfs_entry *ret_entry, unsigned *re
                     return -ENOTDIR;
                 }
 
+                // a directory without blocks has no entries yet
+                if (current_entry.first_block == SFS_BLOCKIDX_END) {
+                    free(path_copy);
+                    return -ENOENT;
+                }
+
                 // descend into subdirectory
                 current_off = SFS_DATA_OFF + current_entry.first_block * SFS_BLOCK_SIZE;
                 entries_per_dir = SFS_DIR_NENTRIES;
@@ -75,35 +326,35 @@ static int get_entry(const char *path, struct sfs_entry *ret_entry, unsigned *re
 }
 
 // getattr maps file or directory metadata to struct stat
-static int sfs_getattr(const char *path, struct stat *st) {
-    struct sfs_entry entry;
-    unsigned entry_off;
-    int res;
-
+static void fill_stat(const struct sfs_entry *entry, struct stat *st) {
     memset(st, 0, sizeof(struct stat));
     st->st_uid = getuid();
     st->st_gid = getgid();
     st->st_atime = time(NULL);
     st->st_mtime = time(NULL);
 
-    res = get_entry(path, &entry, &entry_off);
-    if (res < 0) return res;
-
-    if (entry.size & SFS_DIRECTORY) {
+    if (entry->size & SFS_DIRECTORY) {
         st->st_mode = S_IFDIR | 0755;
         st->st_nlink = 2;
     } else {
         st->st_mode = S_IFREG | 0644;
         st->st_nlink = 1;
-        st->st_size = entry.size & SFS_SIZEMASK;
+        st->st_size = file_size_of(entry);
     }
+}
 
+static int sfs_getattr_locked(const char *path, struct stat *st) {
+    struct sfs_entry entry;
+    unsigned entry_off;
+    int res = get_entry(path, &entry, &entry_off);
+    if (res < 0) return res;
+    fill_stat(&entry, st);
     return 0;
 }
 
 // readdir lists names only, type info comes through getattr
-static int sfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
-                       off_t offset, struct fuse_file_info *fi) {
+static int sfs_readdir_locked(const char *path, void *buf, fuse_fill_dir_t filler,
+                              off_t offset, struct fuse_file_info *fi) {
     (void)offset;
     (void)fi;
 
@@ -125,456 +376,2926 @@ static int sfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
         entries_count = SFS_ROOTDIR_NENTRIES;
     } else {
         dir_off = SFS_DATA_OFF + entry.first_block * SFS_BLOCK_SIZE;
-        entries_count = SFS_DIR_NENTRIES;
+        entries_count = entry.first_block == SFS_BLOCKIDX_END ? 0 : SFS_DIR_NENTRIES;
     }
 
     // read each entry and add names
     struct sfs_entry curr;
-    for (unsigned i = 0; i < entries_count; i++) {
-        disk_read(&curr, sizeof(curr), dir_off + i * sizeof(struct sfs_entry));
+    unsigned curr_off;
+    struct dir_scan scan;
+    dir_scan_start(&scan, dir_off, entries_count);
+    while (dir_scan_next(&scan, &curr, &curr_off))
         if (strlen(curr.filename) > 0) filler(buf, curr.filename, NULL, 0);
-    }
 
     return 0;
 }
 
-// read copies up to size bytes from offset, respects end of file
-static int sfs_read(const char *path, char *buf, size_t size, off_t offset,
-                    struct fuse_file_info *fi) {
-    (void)fi;
-
-    struct sfs_entry entry;
-    unsigned entry_off;
-    int res = get_entry(path, &entry, &entry_off);
-    if (res < 0) return res;
-    if (entry.size & SFS_DIRECTORY) return -EISDIR;
+// space and entry accounting for statfs, counted once at mount and kept up
+// to date by the allocator and the directory operations
+static unsigned free_blocks;   // table entries marked empty
+static unsigned entry_slots;   // directory slots in the root area and all directories
+static unsigned used_entries;  // slots holding a file or directory
+
+// block table access. the table is kept in memory from mount on, so reads
+// never go to the disk. a plain image writes every change through at once:
+// entries, data and free list links go out as the callbacks run, and a table
+// that lagged behind them would hand an entry's blocks to another file after
+// a crash. a shadowed table (see sfs_format.h), which has a recovery walk for
+// that, is split into pages of SFS_TABLE_PAGE bytes and changes only mark
+// their pages dirty. a background thread commits them every
+// SFS_WRITEBACK_DELAY seconds or once SFS_WRITEBACK_PAGES of them pile up,
+// neighbouring pages in one write; fsync and unmount do it at once. blocks
+// freed in between are held back from the allocator until the commit that
+// records them free is durable, so after a crash no entry can point into a
+// chain the last committed table gives to another file. without memory for
+// the table every access goes to the disk
+#define SFS_WRITEBACK_PAGES 64
+
+static blockidx_t *live_table;
+static uint32_t table_dirty[SFS_TABLE_MAP_WORDS]; // pages changed since the last writeback
+static unsigned table_ndirty;
+static blockidx_t *held;                          // blocks freed since the last commit
+static unsigned nheld;
+static uint8_t *held_map;
+static uint8_t *punch_busy;                       // free blocks out for hole punching
+static pthread_cond_t writeback_wake = PTHREAD_COND_INITIALIZER;
+
+static int use_shadow(void) {
+    return has_super && (super.features & SFS_FEAT_SHADOW) && live_table;
+}
 
-    uint32_t file_size = entry.size & SFS_SIZEMASK;
-    if (offset >= file_size) return 0;
+// whether the allocator passes a free block by: freed since the last commit,
+// or being punched out of the image file
+static int is_held(blockidx_t block) {
+    return (held_map && (held_map[block / 8] & (1u << (block % 8)))) ||
+           (punch_busy && (punch_busy[block / 8] & (1u << (block % 8))));
+}
 
-    if (offset + size > file_size) size = file_size - offset;
+// dirty pages that wake the writeback thread early, a quarter of a small table
+static unsigned writeback_pages(void) {
+    if (SFS_TABLE_PAGES / 4 < SFS_WRITEBACK_PAGES) return SFS_TABLE_PAGES / 4 + 1;
+    return SFS_WRITEBACK_PAGES;
+}
 
-    blockidx_t current_block = entry.first_block;
-    unsigned bytes_read = 0;
-    off_t current_offset = offset;
+// read count table entries from first on
+static void table_read(blockidx_t *entries, unsigned count, blockidx_t first) {
+    if (live_table)
+        memcpy(entries, live_table + first, count * sizeof(blockidx_t));
+    else
+        disk_read(entries, count * sizeof(blockidx_t),
+                  SFS_BLOCKTBL_OFF + first * sizeof(blockidx_t));
+}
 
-    // skip full blocks to reach starting offset
-    while (current_offset >= SFS_BLOCK_SIZE) {
-        blockidx_t next_block;
-        disk_read(&next_block, sizeof(next_block),
-                  SFS_BLOCKTBL_OFF + current_block * sizeof(blockidx_t));
-        if (next_block == SFS_BLOCKIDX_END) return bytes_read;
-        current_block = next_block;
-        current_offset -= SFS_BLOCK_SIZE;
+static void table_write(const blockidx_t *entries, unsigned count, blockidx_t first) {
+    if (live_table) memcpy(live_table + first, entries, count * sizeof(blockidx_t));
+    if (!use_shadow()) {
+        disk_write(entries, count * sizeof(blockidx_t),
+                   SFS_BLOCKTBL_OFF + first * sizeof(blockidx_t));
+        return;
+    }
+    unsigned last = (first + count - 1) / SFS_TABLE_PAGE_ENTRIES;
+    for (unsigned p = first / SFS_TABLE_PAGE_ENTRIES; p <= last; p++) {
+        if (table_dirty[p / 32] & (1u << (p % 32))) continue;
+        table_dirty[p / 32] |= 1u << (p % 32);
+        if (++table_ndirty == writeback_pages()) pthread_cond_signal(&writeback_wake);
     }
+}
 
-    // read from the chain
-    while (bytes_read < size) {
-        unsigned block_offset = current_offset;
-        unsigned can_read = SFS_BLOCK_SIZE - block_offset;
-        if (can_read > size - bytes_read) can_read = size - bytes_read;
+// blocks in the contiguous run that holds a directory's entry array
+#define SFS_DIR_BLOCKS \
+    ((SFS_DIR_NENTRIES * sizeof(struct sfs_entry) + SFS_BLOCK_SIZE - 1) / SFS_BLOCK_SIZE)
 
-        disk_read(buf + bytes_read, can_read,
-                  SFS_DATA_OFF + current_block * SFS_BLOCK_SIZE + block_offset);
+// placement tuning: table entries fetched per scan read, and free blocks left
+// behind another file's tail before a new file or directory may start
+#define SFS_SCAN_CHUNK 256
+#define SFS_HEAD_GAP 32
 
-        bytes_read += can_read;
-        current_offset = 0;
+static int use_freelist(void) {
+    return has_super && (super.features & SFS_FEAT_FREELIST);
+}
 
-        if (bytes_read < size) {
-            blockidx_t next_block;
-            disk_read(&next_block, sizeof(next_block),
-                      SFS_BLOCKTBL_OFF + current_block * sizeof(blockidx_t));
-            if (next_block == SFS_BLOCKIDX_END) break;
-            current_block = next_block;
+// scan the block table from goal, wrapping around, for len consecutive free
+// blocks and return the last block of that run
+static blockidx_t scan_free_run(blockidx_t goal, unsigned len) {
+    blockidx_t chunk[SFS_SCAN_CHUNK];
+    if (goal >= SFS_BLOCKTBL_NENTRIES) goal = 0;
+
+    unsigned run = 0;
+    for (unsigned n = 0; n < SFS_BLOCKTBL_NENTRIES; ) {
+        unsigned i = (goal + n) % SFS_BLOCKTBL_NENTRIES;
+        unsigned count = SFS_BLOCKTBL_NENTRIES - i;
+        if (count > SFS_SCAN_CHUNK) count = SFS_SCAN_CHUNK;
+        if (count > SFS_BLOCKTBL_NENTRIES - n) count = SFS_BLOCKTBL_NENTRIES - n;
+        if (i == 0) run = 0; // a run does not continue across the wrap
+
+        table_read(chunk, count, i);
+        for (unsigned j = 0; j < count; j++) {
+            if (chunk[j] != SFS_BLOCKIDX_EMPTY || i + j == SFS_BLOCKIDX_EMPTY || is_held(i + j)) {
+                run = 0;
+                continue;
+            }
+            if (++run >= len) return i + j;
         }
+        n += count;
     }
+    return SFS_BLOCKIDX_EMPTY;
+}
 
-    return (int)bytes_read;
+// find len contiguous free blocks near goal and return the first one. with
+// gap > 0 the run must follow at least gap free blocks, so new chains start
+// in open space instead of right behind a neighbour that may still grow
+static blockidx_t find_free_run(blockidx_t goal, unsigned gap, unsigned len) {
+    blockidx_t last = scan_free_run(goal, gap + len);
+    if (last == SFS_BLOCKIDX_EMPTY && gap > 0) last = scan_free_run(goal, len);
+    if (last == SFS_BLOCKIDX_EMPTY) return SFS_BLOCKIDX_EMPTY;
+    return last - (len - 1);
 }
 
-// scan the block table for a free block
-static blockidx_t find_free_block(void) {
-    blockidx_t block_idx;
-    for (unsigned i = 0; i < SFS_BLOCKTBL_NENTRIES; i++) {
-        disk_read(&block_idx, sizeof(block_idx),
-                  SFS_BLOCKTBL_OFF + i * sizeof(blockidx_t));
-        if (block_idx == SFS_BLOCKIDX_EMPTY) return i;
+// check that the len blocks starting at first are all free
+static int run_is_free(unsigned first, unsigned len) {
+    blockidx_t chunk[SFS_SCAN_CHUNK];
+    if (first >= SFS_BLOCKTBL_NENTRIES || len > SFS_BLOCKTBL_NENTRIES - first) return 0;
+
+    for (unsigned n = 0; n < len; ) {
+        unsigned count = len - n < SFS_SCAN_CHUNK ? len - n : SFS_SCAN_CHUNK;
+        table_read(chunk, count, first + n);
+        for (unsigned j = 0; j < count; j++)
+            if (chunk[j] != SFS_BLOCKIDX_EMPTY || first + n + j == SFS_BLOCKIDX_EMPTY ||
+                is_held(first + n + j))
+                return 0;
+        n += count;
     }
+    return 1;
+}
+
+// offset of a block's free list link
+static unsigned freelink_off(blockidx_t block) {
+    return SFS_DATA_OFF + super.freelink_start * SFS_BLOCK_SIZE +
+           block * sizeof(struct sfs_freelink);
+}
+
+// take a free block off the list, wherever it sits
+static void freelist_remove(blockidx_t block) {
+    struct sfs_freelink link;
+    disk_read(&link, sizeof(link), freelink_off(block));
+
+    if (link.prev == SFS_BLOCKIDX_END)
+        super.free_head = link.next;
+    else
+        disk_write(&link.next, sizeof(link.next),
+                   freelink_off(link.prev) + offsetof(struct sfs_freelink, next));
+    if (link.next != SFS_BLOCKIDX_END)
+        disk_write(&link.prev, sizeof(link.prev),
+                   freelink_off(link.next) + offsetof(struct sfs_freelink, prev));
+}
+
+// put a freed block at the head of the list
+static void freelist_push(blockidx_t block) {
+    struct sfs_freelink link = { SFS_BLOCKIDX_END, (blockidx_t)super.free_head };
+    disk_write(&link, sizeof(link), freelink_off(block));
+    if (link.next != SFS_BLOCKIDX_END)
+        disk_write(&block, sizeof(block),
+                   freelink_off(link.next) + offsetof(struct sfs_freelink, prev));
+    super.free_head = block;
+}
+
+// free list placement: the run right at goal (behind gap free blocks) when it
+// is free, otherwise the head of the list. a few table entries are checked
+// instead of scanning, only multi block runs the head cannot supply fall back
+// to the scan
+static blockidx_t freelist_find(blockidx_t goal, unsigned gap, unsigned len) {
+    if (run_is_free(goal, gap + len)) return goal + gap;
+    if (super.free_head != SFS_BLOCKIDX_END && run_is_free(super.free_head, len))
+        return super.free_head;
+    if (len > 1) return find_free_run(goal, 0, len);
     return SFS_BLOCKIDX_EMPTY;
 }
 
-// allocate a free block and return it
-static int allocate_block(blockidx_t *block) {
-    blockidx_t new_block = find_free_block();
-    if (new_block == SFS_BLOCKIDX_EMPTY) return -ENOSPC;
-    *block = new_block;
-    return 0;
+// in memory buddy index over the free blocks, built at mount when enabled.
+// every free block belongs to exactly one free piece of 1 << order blocks,
+// aligned to its size; pieces of one order are kept on a list threaded
+// through per block arrays. it answers "give me a contiguous run of n blocks"
+// without a table scan, and pieces merge back with their buddy when freed
+#define SFS_BUDDY_ORDERS 11 // pieces of up to 1024 blocks
+#define SFS_EXTENT_MAX (1u << (SFS_BUDDY_ORDERS - 1))
+
+static int buddy_enabled;                      // set by main
+static uint8_t *buddy_order;                   // order + 1 at the first block of a free piece
+static blockidx_t *buddy_next, *buddy_prev;
+static blockidx_t buddy_head[SFS_BUDDY_ORDERS];
+
+static void buddy_link(blockidx_t block, unsigned order) {
+    buddy_order[block] = order + 1;
+    buddy_prev[block] = SFS_BLOCKIDX_END;
+    buddy_next[block] = buddy_head[order];
+    if (buddy_head[order] != SFS_BLOCKIDX_END) buddy_prev[buddy_head[order]] = block;
+    buddy_head[order] = block;
 }
 
-// free a chain of blocks by walking the table
-static void free_block_chain(blockidx_t start_block) {
-    while (start_block != SFS_BLOCKIDX_END && start_block != SFS_BLOCKIDX_EMPTY) {
-        blockidx_t next_block;
-        disk_read(&next_block, sizeof(next_block),
-                  SFS_BLOCKTBL_OFF + start_block * sizeof(blockidx_t));
+static void buddy_unlink(blockidx_t block) {
+    unsigned order = buddy_order[block] - 1;
+    if (buddy_prev[block] == SFS_BLOCKIDX_END) buddy_head[order] = buddy_next[block];
+    else buddy_next[buddy_prev[block]] = buddy_next[block];
+    if (buddy_next[block] != SFS_BLOCKIDX_END) buddy_prev[buddy_next[block]] = buddy_prev[block];
+    buddy_order[block] = 0;
+}
 
-        blockidx_t empty = SFS_BLOCKIDX_EMPTY;
-        disk_write(&empty, sizeof(empty),
-                   SFS_BLOCKTBL_OFF + start_block * sizeof(blockidx_t));
+// add a free piece, merging it with its buddy as long as that is free too
+static void buddy_free_piece(unsigned block, unsigned order) {
+    while (order + 1 < SFS_BUDDY_ORDERS) {
+        unsigned buddy = block ^ (1u << order);
+        if (buddy + (1u << order) > SFS_BLOCKTBL_NENTRIES || buddy_order[buddy] != order + 1)
+            break;
+        buddy_unlink(buddy);
+        if (buddy < block) block = buddy;
+        order++;
+    }
+    buddy_link(block, order);
+}
 
-        start_block = next_block;
+// add a free range as the largest aligned pieces that fit it
+static void buddy_free_range(unsigned first, unsigned len) {
+    while (len > 0) {
+        unsigned order = 0;
+        while (order + 1 < SFS_BUDDY_ORDERS && !(first & ((2u << order) - 1)) &&
+               (2u << order) <= len)
+            order++;
+        buddy_free_piece(first, order);
+        first += 1u << order;
+        len -= 1u << order;
     }
 }
 
-// find a free directory slot and return its offset
-static int find_free_entry(unsigned dir_off, unsigned num_entries, unsigned *ret_entry_off) {
-    struct sfs_entry entry;
-    for (unsigned i = 0; i < num_entries; i++) {
-        disk_read(&entry, sizeof(entry), dir_off + i * sizeof(struct sfs_entry));
-        if (strlen(entry.filename) == 0) {
-            *ret_entry_off = dir_off + i * sizeof(struct sfs_entry);
-            return 0;
+// remove a free range from the index, returning the parts of the pieces it
+// cut that lie outside it
+static void buddy_take(unsigned first, unsigned len) {
+    unsigned pos = first, end = first + len;
+    while (pos < end) {
+        unsigned order = 0, piece = pos;
+        while (order < SFS_BUDDY_ORDERS && buddy_order[piece] != order + 1) {
+            order++;
+            piece = pos & ~((1u << order) - 1);
         }
+        if (order == SFS_BUDDY_ORDERS) { pos++; continue; } // not indexed
+
+        unsigned piece_end = piece + (1u << order);
+        buddy_unlink(piece);
+        buddy_free_range(piece, pos - piece);
+        if (piece_end > end) buddy_free_range(end, piece_end - end);
+        pos = piece_end;
     }
-    return -ENOSPC;
 }
 
-// check whether a directory contains no named entries
-static int check_dir_empty(unsigned dir_off, unsigned num_entries) {
-    struct sfs_entry entry;
-    for (unsigned i = 0; i < num_entries; i++) {
-        disk_read(&entry, sizeof(entry), dir_off + i * sizeof(struct sfs_entry));
-        if (strlen(entry.filename) > 0) return -ENOTEMPTY;
+// find a free run for len blocks: the smallest piece holding all of it, else
+// the largest piece there is. sets len to what the run holds
+static blockidx_t buddy_find(unsigned *len) {
+    unsigned want = 0;
+    while (want + 1 < SFS_BUDDY_ORDERS && (1u << want) < *len) want++;
+
+    for (unsigned order = want; order < SFS_BUDDY_ORDERS; order++) {
+        if (buddy_head[order] == SFS_BLOCKIDX_END) continue;
+        if ((1u << order) < *len) *len = 1u << order;
+        return buddy_head[order];
+    }
+    for (unsigned order = want; order-- > 0; ) {
+        if (buddy_head[order] == SFS_BLOCKIDX_END) continue;
+        *len = 1u << order;
+        return buddy_head[order];
     }
+    return SFS_BLOCKIDX_EMPTY;
+}
+
+// load the index from the table, one chunked pass. without memory for it the
+// mount simply runs without the index
+static void buddy_build(void) {
+    blockidx_t chunk[SFS_SCAN_CHUNK];
+
+    free(buddy_order);
+    free(buddy_next);
+    free(buddy_prev);
+    buddy_order = calloc(SFS_BLOCKTBL_NENTRIES, sizeof(*buddy_order));
+    buddy_next = malloc(SFS_BLOCKTBL_NENTRIES * sizeof(blockidx_t));
+    buddy_prev = malloc(SFS_BLOCKTBL_NENTRIES * sizeof(blockidx_t));
+    if (!buddy_order || !buddy_next || !buddy_prev) {
+        buddy_enabled = 0;
+        return;
+    }
+    for (unsigned order = 0; order < SFS_BUDDY_ORDERS; order++)
+        buddy_head[order] = SFS_BLOCKIDX_END;
+
+    unsigned run_start = 0, run = 0;
+    for (unsigned i = 0; i < SFS_BLOCKTBL_NENTRIES; i += SFS_SCAN_CHUNK) {
+        unsigned count = SFS_BLOCKTBL_NENTRIES - i;
+        if (count > SFS_SCAN_CHUNK) count = SFS_SCAN_CHUNK;
+        table_read(chunk, count, i);
+        for (unsigned j = 0; j < count; j++) {
+            if (chunk[j] == SFS_BLOCKIDX_EMPTY && i + j != SFS_BLOCKIDX_EMPTY) {
+                if (run++ == 0) run_start = i + j;
+                continue;
+            }
+            buddy_free_range(run_start, run);
+            run = 0;
+        }
+    }
+    buddy_free_range(run_start, run);
+}
+
+// choose len free blocks near goal without taking them
+static blockidx_t pick_free_run(blockidx_t goal, unsigned gap, unsigned len) {
+    if (use_freelist()) return freelist_find(goal, gap, len);
+    return find_free_run(goal, gap, len);
+}
+
+// take len free blocks starting at first, the caller links them
+static void claim_run(blockidx_t first, unsigned len) {
+    if (use_freelist())
+        for (unsigned i = 0; i < len; i++) freelist_remove(first + i);
+    if (buddy_enabled) buddy_take(first, len);
+    free_blocks -= len;
+}
+
+// allocate len contiguous blocks near goal, the caller links them
+static int allocate_run(blockidx_t goal, unsigned gap, unsigned len, blockidx_t *first) {
+    blockidx_t start = pick_free_run(goal, gap, len);
+    if (start == SFS_BLOCKIDX_EMPTY) return -ENOSPC;
+    claim_run(start, len);
+    *first = start;
     return 0;
 }
 
-// mkdir creates a new directory entry and initialises its blocks
-static int sfs_mkdir(const char *path, mode_t mode) {
-    (void)mode;
+// allocate a free block near goal and return it, the caller links it in
+static int allocate_block(blockidx_t goal, unsigned gap, blockidx_t *block) {
+    return allocate_run(goal, gap, 1, block);
+}
 
-    char *last_slash = strrchr(path, '/');
-    if (!last_slash || strlen(last_slash + 1) >= SFS_FILENAME_MAX) return -ENAMETOOLONG;
+// placement goal for the first block of a file: right after the directory
+// block that holds its entry, so a directory's files stay near it
+static blockidx_t entry_goal(unsigned entry_off) {
+    if (entry_off < SFS_DATA_OFF) return 0; // entry lives in the root area
+    return (entry_off - SFS_DATA_OFF) / SFS_BLOCK_SIZE + 1;
+}
 
-    // already exists
-    struct sfs_entry existing;
-    unsigned existing_off;
-    if (get_entry(path, &existing, &existing_off) == 0) return -EEXIST;
+// placement goal for a directory's entry array: top level directories are
+// spread over the data region by name hash, nested ones start next to the
+// block holding their entry
+static blockidx_t dir_goal(const char *path, unsigned entry_off) {
+    if (entry_off >= SFS_DATA_OFF) return entry_goal(entry_off);
 
-    // locate parent
-    char *parent_path = strdup(path);
-    if (!parent_path) return -ENOMEM;
-    parent_path[last_slash - path] = '\0';
-    if (strlen(parent_path) == 0) strcpy(parent_path, "/");
+    uint32_t hash = 2166136261u;
+    for (const char *p = path; *p; p++) hash = (hash ^ (unsigned char)*p) * 16777619u;
+    return hash % SFS_BLOCKTBL_NENTRIES;
+}
 
-    struct sfs_entry parent;
-    unsigned parent_off;
-    int res = get_entry(parent_path, &parent, &parent_off);
-    if (res < 0) { free(parent_path); return res; }
-    if (!(parent.size & SFS_DIRECTORY)) { free(parent_path); return -ENOTDIR; }
-
-    unsigned parent_dir_off = (strcmp(parent_path, "/") == 0)
-        ? SFS_ROOTDIR_OFF
-        : SFS_DATA_OFF + parent.first_block * SFS_BLOCK_SIZE;
-    unsigned num_entries = (strcmp(parent_path, "/") == 0)
-        ? SFS_ROOTDIR_NENTRIES
-        : SFS_DIR_NENTRIES;
-    free(parent_path);
+// count the free blocks starting right at goal, up to max
+static unsigned free_run_at(blockidx_t goal, unsigned max) {
+    blockidx_t chunk[SFS_SCAN_CHUNK];
+    unsigned n = 0;
+    while (n < max && goal + n < SFS_BLOCKTBL_NENTRIES) {
+        unsigned count = max - n < SFS_SCAN_CHUNK ? max - n : SFS_SCAN_CHUNK;
+        if (count > SFS_BLOCKTBL_NENTRIES - goal - n) count = SFS_BLOCKTBL_NENTRIES - goal - n;
+        table_read(chunk, count, goal + n);
+        for (unsigned j = 0; j < count; j++) {
+            if (chunk[j] != SFS_BLOCKIDX_EMPTY || goal + n == SFS_BLOCKIDX_EMPTY ||
+                is_held(goal + n))
+                return n;
+            n++;
+        }
+    }
+    return n;
+}
 
-    // directory uses a fixed array of entries that fits in a two block chain
-    blockidx_t first_block = find_free_block();
-    if (first_block == SFS_BLOCKIDX_EMPTY) return -ENOSPC;
-    blockidx_t second_block = find_free_block();
-    if (second_block == SFS_BLOCKIDX_EMPTY) return -ENOSPC;
+// allocate up to want contiguous blocks to extend a chain: the free blocks
+// right at goal first, so the chain stays in one run, then a run from the
+// buddy index, and without the index a single block near goal. returns the
+// number of blocks allocated, the caller links them
+static int allocate_extent(blockidx_t goal, unsigned want, blockidx_t *first) {
+    if (want > SFS_EXTENT_MAX) want = SFS_EXTENT_MAX;
+
+    unsigned len = free_run_at(goal, want);
+    if (len > 0) {
+        *first = goal;
+    } else if (buddy_enabled) {
+        len = want;
+        *first = buddy_find(&len);
+        if (*first == SFS_BLOCKIDX_EMPTY) return -ENOSPC;
+    } else {
+        int res = allocate_block(goal, 0, first);
+        return res < 0 ? res : 1;
+    }
+    claim_run(*first, len);
+    return (int)len;
+}
 
-    // link first to second and close with END
-    disk_write(&second_block, sizeof(blockidx_t),
-               SFS_BLOCKTBL_OFF + first_block * sizeof(blockidx_t));
-    blockidx_t end_marker = SFS_BLOCKIDX_END;
-    disk_write(&end_marker, sizeof(blockidx_t),
-               SFS_BLOCKTBL_OFF + second_block * sizeof(blockidx_t));
+// link len blocks starting at first as one run that ends the chain, hooked
+// behind tail unless the run starts a new chain (tail is the end marker)
+static void link_extent(blockidx_t tail, blockidx_t first, unsigned len) {
+    blockidx_t links[SFS_EXTENT_MAX];
+    for (unsigned i = 0; i + 1 < len; i++) links[i] = first + i + 1;
+    links[len - 1] = SFS_BLOCKIDX_END;
+    table_write(links, len, first);
+    if (tail != SFS_BLOCKIDX_END)
+        table_write(&first, 1, tail);
+}
 
-    // zero out directory entry array
-    struct sfs_entry empty_entry = {0};
-    empty_entry.first_block = SFS_BLOCKIDX_EMPTY;
-    for (unsigned i = 0; i < SFS_DIR_NENTRIES; i++) {
-        disk_write(&empty_entry, sizeof(empty_entry),
-                   SFS_DATA_OFF + first_block * SFS_BLOCK_SIZE +
-                   i * sizeof(struct sfs_entry));
+// allocate the start of a new chain: one block near the file's directory,
+// behind the head gap, or a whole run from the buddy index when more than one
+// block is wanted. the run is linked and ended, returns its length
+static int allocate_head(unsigned entry_off, unsigned want, blockidx_t *first) {
+    unsigned len = 1;
+    if (buddy_enabled && want > 1) {
+        len = want > SFS_EXTENT_MAX ? SFS_EXTENT_MAX : want;
+        *first = buddy_find(&len);
+        if (*first == SFS_BLOCKIDX_EMPTY) return -ENOSPC;
+        claim_run(*first, len);
+    } else {
+        int res = allocate_block(entry_goal(entry_off), SFS_HEAD_GAP, first);
+        if (res < 0) return res;
     }
+    link_extent(SFS_BLOCKIDX_END, *first, len);
+    return (int)len;
+}
 
-    // allocate slot in parent and write the new directory entry
-    unsigned new_entry_off;
-    res = find_free_entry(parent_dir_off, num_entries, &new_entry_off);
-    if (res < 0) return res;
+// zero bytes [from, to) of a data block. neither mkfs nor free_block_chain
+// clears data, so a block is zeroed where its new owner does not overwrite it;
+// past the end of a file a chain always reads as zeroes
+static void zero_block_range(blockidx_t block, unsigned from, unsigned to) {
+    static const char zeros[SFS_BLOCK_SIZE];
+    if (from >= to) return;
+    disk_write(zeros + from, to - from, SFS_DATA_OFF + block * SFS_BLOCK_SIZE + from);
+}
 
-    struct sfs_entry new_dir = {0};
-    strncpy(new_dir.filename, last_slash + 1, SFS_FILENAME_MAX - 1);
-    new_dir.first_block = first_block;
-    new_dir.size = SFS_DIRECTORY;
+// host side hole punching: freed blocks are queued as coalesced ranges and a
+// background thread punches them out of the image file, so sparse backing
+// storage gets the space back. a bit per block remembers a punched block until
+// it is freed again; it reads as zeroes, so its next owner skips zeroing it
+#define SFS_PUNCH_QUEUE 256
+#define SFS_PUNCH_DELAY 1 // seconds between punch passes
+
+// image file, opened a second time for hole punching and to flush table
+// writebacks; the disk layer keeps its descriptor to itself (set by main)
+static const char *image_path;
+static int image_fd = -1;
+
+static int punch_holes; // punch freed blocks out of the image file (set by main)
+static int punching;    // cleared when the host file system has no holes
+static uint8_t *punched;
+struct punch_range {
+    blockidx_t first;
+    unsigned len;
+};
+
+static struct punch_range punch_queue[SFS_PUNCH_QUEUE];
+static unsigned punch_queued;
+static pthread_cond_t punch_wake = PTHREAD_COND_INITIALIZER;
+
+static int is_punched(blockidx_t block) {
+    return punched && (punched[block / 8] & (1u << (block % 8)));
+}
 
-    disk_write(&new_dir, sizeof(new_dir), new_entry_off);
-    return 0;
+// queue a freed block, growing the last range when it borders it. a block
+// that finds the queue full is not punched, which only costs space
+static void punch_note(blockidx_t block) {
+    if (!punching) return;
+    punched[block / 8] &= ~(1u << (block % 8));
+    if (punch_queued > 0) {
+        unsigned last = punch_queued - 1;
+        if (block == punch_queue[last].first + punch_queue[last].len) {
+            punch_queue[last].len++;
+            return;
+        }
+        if (block + 1 == punch_queue[last].first) {
+            punch_queue[last].first = block;
+            punch_queue[last].len++;
+            return;
+        }
+    }
+    if (punch_queued == SFS_PUNCH_QUEUE) return;
+    punch_queue[punch_queued].first = block;
+    punch_queue[punch_queued].len = 1;
+    if (++punch_queued == SFS_PUNCH_QUEUE) pthread_cond_signal(&punch_wake);
 }
 
-// rmdir removes an empty directory and frees its block chain
-static int sfs_rmdir(const char *path) {
-    if (strcmp(path, "/") == 0) return -EBUSY;
+// zero the part of a freshly allocated block its owner does not write
+static void zero_fresh_range(blockidx_t block, unsigned from, unsigned to) {
+    if (!is_punched(block)) zero_block_range(block, from, to);
+}
 
-    struct sfs_entry entry;
-    unsigned entry_off;
-    int res = get_entry(path, &entry, &entry_off);
-    if (res < 0) return res;
-    if (!(entry.size & SFS_DIRECTORY)) return -ENOTDIR;
+// give a free block to the allocator
+static void hand_back(blockidx_t block) {
+    punch_note(block);
+    if (use_freelist()) freelist_push(block);
+    if (buddy_enabled) buddy_free_piece(block, 0);
+    free_blocks++;
+}
 
-    unsigned dir_off = SFS_DATA_OFF + entry.first_block * SFS_BLOCK_SIZE;
-    res = check_dir_empty(dir_off, SFS_DIR_NENTRIES);
-    if (res < 0) return res;
+// hand back a block whose table entry was just marked empty, with a shadowed
+// table only once the next commit is durable
+static void release_block(blockidx_t block) {
+    if (!use_shadow()) {
+        hand_back(block);
+        return;
+    }
+    if (is_held(block)) return;
+    held_map[block / 8] |= 1u << (block % 8);
+    held[nheld++] = block;
+}
 
-    // free the chain
-    blockidx_t current_block = entry.first_block;
-    while (current_block != SFS_BLOCKIDX_END) {
+// free a chain of blocks by walking the table
+static void free_block_chain(blockidx_t start_block) {
+    while (start_block != SFS_BLOCKIDX_END && start_block != SFS_BLOCKIDX_EMPTY) {
         blockidx_t next_block;
-        disk_read(&next_block, sizeof(next_block),
-                  SFS_BLOCKTBL_OFF + current_block * sizeof(blockidx_t));
-        blockidx_t empty_marker = SFS_BLOCKIDX_EMPTY;
-        disk_write(&empty_marker, sizeof(empty_marker),
-                   SFS_BLOCKTBL_OFF + current_block * sizeof(blockidx_t));
-        current_block = next_block;
+        table_read(&next_block, 1, start_block);
+
+        blockidx_t empty = SFS_BLOCKIDX_EMPTY;
+        table_write(&empty, 1, start_block);
+        release_block(start_block);
+
+        start_block = next_block;
     }
+}
 
-    // clear the directory entry in parent
-    struct sfs_entry empty_entry = {0};
-    empty_entry.first_block = SFS_BLOCKIDX_EMPTY;
-    disk_write(&empty_entry, sizeof(empty_entry), entry_off);
+static int use_skipidx(void) {
+    return has_super && (super.features & SFS_FEAT_SKIPIDX);
+}
 
-    return 0;
+// offset of the skip index reference kept for a chain's first block
+static unsigned skipref_off(blockidx_t head) {
+    return SFS_DATA_OFF + super.skipref_start * SFS_BLOCK_SIZE + head * sizeof(blockidx_t);
 }
 
-// unlink removes a regular file, frees blocks, and clears its directory entry
-static int sfs_unlink(const char *path) {
-    struct sfs_entry entry;
-    unsigned entry_off;
-    int res = get_entry(path, &entry, &entry_off);
-    if (res < 0) return res;
-    if (entry.size & SFS_DIRECTORY) return -EISDIR;
+// the skip index reference stored for head, as read
+static blockidx_t skipidx_ref(blockidx_t head) {
+    blockidx_t idx = SFS_BLOCKIDX_EMPTY;
+    if (use_skipidx() && head != SFS_BLOCKIDX_END)
+        disk_read(&idx, sizeof(idx), skipref_off(head));
+    return idx;
+}
 
-    free_block_chain(entry.first_block);
+static int is_reserved(blockidx_t block) {
+    return block == SFS_BLOCKIDX_EMPTY ||
+           (block >= super.meta_start && block <= SFS_SUPER_BLOCK);
+}
 
-    struct sfs_entry empty_entry = {0};
-    empty_entry.first_block = SFS_BLOCKIDX_EMPTY;
-    disk_write(&empty_entry, sizeof(empty_entry), entry_off);
-    return 0;
+// whether idx can be a skip index block: in range, outside the reserved
+// blocks and a chain of one block. a reference failing this is stale
+static int skipidx_valid(blockidx_t idx) {
+    if (idx >= SFS_BLOCKTBL_NENTRIES || is_reserved(idx)) return 0;
+    blockidx_t next;
+    table_read(&next, 1, idx);
+    return next == SFS_BLOCKIDX_END;
 }
 
-// create makes an empty file entry in the parent directory
-static int sfs_create(const char *path, mode_t mode, struct fuse_file_info *fi) {
-    (void)mode;
-    (void)fi;
+static blockidx_t get_skipidx(blockidx_t head) {
+    blockidx_t idx = skipidx_ref(head);
+    return idx != SFS_BLOCKIDX_EMPTY && skipidx_valid(idx) ? idx : SFS_BLOCKIDX_EMPTY;
+}
 
-    char *last_slash = strrchr(path, '/');
-    if (!last_slash || strlen(last_slash + 1) >= SFS_FILENAME_MAX) return -ENAMETOOLONG;
+static void set_skipidx(blockidx_t head, blockidx_t idx) {
+    disk_write(&idx, sizeof(idx), skipref_off(head));
+}
 
-    struct sfs_entry existing;
-    unsigned existing_off;
-    if (get_entry(path, &existing, &existing_off) == 0) return -EEXIST;
+// free a chain's skip index block, if it has one
+static void drop_skipidx(blockidx_t head) {
+    blockidx_t idx = skipidx_ref(head);
+    if (idx == SFS_BLOCKIDX_EMPTY) return;
 
-    // locate parent
-    char *parent_path = strdup(path);
+    if (skipidx_valid(idx)) {
+        blockidx_t empty = SFS_BLOCKIDX_EMPTY;
+        table_write(&empty, 1, idx);
+        release_block(idx);
+    }
+    set_skipidx(head, SFS_BLOCKIDX_EMPTY);
+}
+
+// record the run of len blocks starting at first, linked at chain positions
+// pos onwards, in the skip index of the chain starting at head. the index
+// block is allocated when the chain first reaches SFS_SKIP_STRIDE blocks; if
+// that fails the chain just goes without and seeks walk the table
+static void skip_note(blockidx_t head, unsigned pos, blockidx_t first, unsigned len) {
+    if (!use_skipidx()) return;
+    unsigned p = (pos + SFS_SKIP_STRIDE - 1) / SFS_SKIP_STRIDE * SFS_SKIP_STRIDE;
+    if (p == 0) p = SFS_SKIP_STRIDE;
+    if (p >= pos + len || p / SFS_SKIP_STRIDE > SFS_SKIP_ENTRIES) return;
+
+    blockidx_t idx = get_skipidx(head);
+    if (idx == SFS_BLOCKIDX_EMPTY) {
+        if (allocate_block(0, 0, &idx) < 0) return;
+        blockidx_t ptrs[SFS_SKIP_ENTRIES];
+        for (unsigned i = 0; i < SFS_SKIP_ENTRIES; i++) ptrs[i] = SFS_BLOCKIDX_EMPTY;
+        disk_write(ptrs, sizeof(ptrs), SFS_DATA_OFF + idx * SFS_BLOCK_SIZE);
+        blockidx_t end_marker = SFS_BLOCKIDX_END;
+        table_write(&end_marker, 1, idx);
+        set_skipidx(head, idx);
+    }
+
+    for (; p < pos + len && p / SFS_SKIP_STRIDE <= SFS_SKIP_ENTRIES; p += SFS_SKIP_STRIDE) {
+        blockidx_t block = first + (p - pos);
+        disk_write(&block, sizeof(block), SFS_DATA_OFF + idx * SFS_BLOCK_SIZE +
+                   (p / SFS_SKIP_STRIDE - 1) * sizeof(blockidx_t));
+    }
+}
+
+// forget the skip pointers at positions a chain cut to kept blocks no longer has
+static void skip_cut(blockidx_t head, unsigned kept) {
+    blockidx_t idx = get_skipidx(head);
+    if (idx == SFS_BLOCKIDX_EMPTY) return;
+
+    unsigned first = (kept + SFS_SKIP_STRIDE - 1) / SFS_SKIP_STRIDE - 1;
+    if (first >= SFS_SKIP_ENTRIES) return;
+    blockidx_t ptrs[SFS_SKIP_ENTRIES];
+    for (unsigned i = first; i < SFS_SKIP_ENTRIES; i++) ptrs[i] = SFS_BLOCKIDX_EMPTY;
+    disk_write(ptrs + first, (SFS_SKIP_ENTRIES - first) * sizeof(blockidx_t),
+               SFS_DATA_OFF + idx * SFS_BLOCK_SIZE + first * sizeof(blockidx_t));
+}
+
+// find the block at chain position pos, starting from the last skip pointer
+// at or before it. only pointers below limit, the positions the file size
+// covers, are trusted. sets reached to the position of the returned block,
+// short of pos when the chain ends first
+static blockidx_t chain_seek(blockidx_t first, unsigned pos, unsigned limit, unsigned *reached) {
+    blockidx_t current = first;
+    unsigned at = 0;
+
+    blockidx_t idx = pos >= SFS_SKIP_STRIDE && limit > 0 ? get_skipidx(first) : SFS_BLOCKIDX_EMPTY;
+    if (idx != SFS_BLOCKIDX_EMPTY) {
+        unsigned n = (pos < limit ? pos : limit - 1) / SFS_SKIP_STRIDE;
+        if (n > SFS_SKIP_ENTRIES) n = SFS_SKIP_ENTRIES;
+        blockidx_t ptrs[SFS_SKIP_ENTRIES];
+        if (n > 0) disk_read(ptrs, n * sizeof(blockidx_t), SFS_DATA_OFF + idx * SFS_BLOCK_SIZE);
+        while (n > 0 && ptrs[n - 1] == SFS_BLOCKIDX_EMPTY) n--;
+        if (n > 0) {
+            current = ptrs[n - 1];
+            at = n * SFS_SKIP_STRIDE;
+        }
+    }
+
+    while (at < pos && current != SFS_BLOCKIDX_END) {
+        blockidx_t next_block;
+        table_read(&next_block, 1, current);
+        if (next_block == SFS_BLOCKIDX_END) break;
+        current = next_block;
+        at++;
+    }
+    *reached = at;
+    return current;
+}
+
+static int use_tailref(void) {
+    return has_super && (super.features & SFS_FEAT_TAIL);
+}
+
+static unsigned tailref_off(blockidx_t head) {
+    return SFS_DATA_OFF + super.tailref_start * SFS_BLOCK_SIZE +
+           head * sizeof(struct sfs_tailref);
+}
+
+// look up the recorded tail of the chain starting at head. returns 0 when
+// there is none or it is stale, the tail block no longer ending a chain
+static int get_tail(blockidx_t head, blockidx_t *tail, unsigned *count) {
+    if (!use_tailref() || head == SFS_BLOCKIDX_END) return 0;
+
+    struct sfs_tailref ref;
+    disk_read(&ref, sizeof(ref), tailref_off(head));
+    if (ref.count == 0 || ref.tail >= SFS_BLOCKTBL_NENTRIES) return 0;
+
+    blockidx_t next_block;
+    table_read(&next_block, 1, ref.tail);
+    if (next_block != SFS_BLOCKIDX_END) return 0;
+
+    *tail = ref.tail;
+    *count = ref.count;
+    return 1;
+}
+
+static void set_tail(blockidx_t head, blockidx_t tail, unsigned count) {
+    if (!use_tailref() || head == SFS_BLOCKIDX_END) return;
+    struct sfs_tailref ref = { count, tail };
+    disk_write(&ref, sizeof(ref), tailref_off(head));
+}
+
+// forget the tail of a chain that is freed. its last block may end another
+// chain later, and a chain starting at head again would append to that one
+static void drop_tail(blockidx_t head) {
+    set_tail(head, SFS_BLOCKIDX_END, 0);
+}
+
+// small file packing, see sfs_format.h. pack blocks known to have free
+// fragments are kept in a small cache, filled as files are packed and freed;
+// after a mount the first small files open new pack blocks
+#define SFS_PACK_OPEN 16
+
+static blockidx_t pack_open[SFS_PACK_OPEN];
+static unsigned pack_nopen;
+
+static unsigned pack_frags(uint32_t len) {
+    return (len + SFS_PACK_FRAG - 1) / SFS_PACK_FRAG;
+}
+
+static unsigned pack_map_off(blockidx_t block) {
+    return SFS_DATA_OFF + block * SFS_BLOCK_SIZE;
+}
+
+static unsigned pack_data_off(const struct sfs_entry *entry) {
+    return pack_map_off(entry->first_block) + SFS_PACK_OFF(entry->size);
+}
+
+static int frag_used(const struct sfs_packmap *map, unsigned frag) {
+    return (map->used[frag / 32] >> (frag % 32)) & 1;
+}
+
+static void mark_frags(struct sfs_packmap *map, unsigned first, unsigned n, int used) {
+    for (unsigned f = first; f < first + n; f++) {
+        if (used) map->used[f / 32] |= 1u << (f % 32);
+        else map->used[f / 32] &= ~(1u << (f % 32));
+    }
+}
+
+// first fragment of a free run of n, 0 if there is none
+static unsigned find_frags(const struct sfs_packmap *map, unsigned n) {
+    unsigned run = 0;
+    for (unsigned f = 1; f < SFS_PACK_FRAGS; f++) {
+        run = frag_used(map, f) ? 0 : run + 1;
+        if (run == n) return f + 1 - n;
+    }
+    return 0;
+}
+
+static void pack_forget(blockidx_t block) {
+    for (unsigned i = 0; i < pack_nopen; i++) {
+        if (pack_open[i] != block) continue;
+        pack_nopen--;
+        memmove(&pack_open[i], &pack_open[i + 1], (pack_nopen - i) * sizeof(blockidx_t));
+        return;
+    }
+}
+
+// cache a pack block with free fragments, the oldest one drops out
+static void pack_remember(blockidx_t block) {
+    for (unsigned i = 0; i < pack_nopen; i++)
+        if (pack_open[i] == block) return;
+    if (pack_nopen == SFS_PACK_OPEN) pack_forget(pack_open[0]);
+    pack_open[pack_nopen++] = block;
+}
+
+// place a run of n fragments in a cached pack block, or in a new one near
+// the entry. returns the block and the byte offset of the run in it
+static int pack_alloc(unsigned entry_off, unsigned n, blockidx_t *block, unsigned *off) {
+    struct sfs_packmap map;
+    for (unsigned i = 0; i < pack_nopen; i++) {
+        disk_read(&map, sizeof(map), pack_map_off(pack_open[i]));
+        unsigned first = find_frags(&map, n);
+        if (first == 0) continue;
+        mark_frags(&map, first, n, 1);
+        disk_write(&map, sizeof(map), pack_map_off(pack_open[i]));
+        *block = pack_open[i];
+        *off = first * SFS_PACK_FRAG;
+        if (find_frags(&map, 1) == 0) pack_forget(*block);
+        return 0;
+    }
+
+    int res = allocate_block(entry_goal(entry_off), SFS_HEAD_GAP, block);
+    if (res < 0) return res;
+    blockidx_t end_marker = SFS_BLOCKIDX_END;
+    table_write(&end_marker, 1, *block);
+    memset(&map, 0, sizeof(map));
+    mark_frags(&map, 0, 1 + n, 1);
+    disk_write(&map, sizeof(map), pack_map_off(*block));
+    pack_remember(*block);
+    *off = SFS_PACK_FRAG;
+    return 0;
+}
+
+// free n fragments from byte offset off of a pack block, the block goes
+// with its last run
+static void pack_release(blockidx_t block, unsigned off, unsigned n) {
+    struct sfs_packmap map;
+    disk_read(&map, sizeof(map), pack_map_off(block));
+    mark_frags(&map, off / SFS_PACK_FRAG, n, 0);
+    for (unsigned f = 1; f < SFS_PACK_FRAGS; f++) {
+        if (!frag_used(&map, f)) continue;
+        disk_write(&map, sizeof(map), pack_map_off(block));
+        pack_remember(block);
+        return;
+    }
+
+    pack_forget(block);
+    blockidx_t empty = SFS_BLOCKIDX_EMPTY;
+    table_write(&empty, 1, block);
+    release_block(block);
+}
+
+static void pack_free(const struct sfs_entry *entry) {
+    pack_release(entry->first_block, SFS_PACK_OFF(entry->size),
+                 pack_frags(SFS_PACK_LEN(entry->size)));
+}
+
+// give a packed or empty file room for len bytes, 0 < len < SFS_PACK_MAX,
+// bytes past the old length reading as zeros. the run grows in place while
+// the fragments behind it are free, otherwise the file moves to a new run.
+// a shadowed table refuses the move: the entry would reach the disk pointing
+// at a block the last commit has free, and recovery would drop the file's
+// committed data with it. sfs-mkfs does not combine the two features
+static int pack_resize(struct sfs_entry *entry, unsigned entry_off, uint32_t len) {
+    int packed = is_packed_file(entry);
+    uint32_t old_len = packed ? SFS_PACK_LEN(entry->size) : 0;
+    unsigned off = packed ? SFS_PACK_OFF(entry->size) : 0;
+    unsigned have = pack_frags(old_len), need = pack_frags(len);
+    blockidx_t block = entry->first_block;
+
+    if (packed && need < have) {
+        pack_release(block, off + need * SFS_PACK_FRAG, have - need);
+        have = need;
+    } else if (packed && need > have) {
+        struct sfs_packmap map;
+        disk_read(&map, sizeof(map), pack_map_off(block));
+        unsigned f = off / SFS_PACK_FRAG + have, end = off / SFS_PACK_FRAG + need;
+        while (f < end && f < SFS_PACK_FRAGS && !frag_used(&map, f)) f++;
+        if (f == end) {
+            mark_frags(&map, off / SFS_PACK_FRAG + have, need - have, 1);
+            disk_write(&map, sizeof(map), pack_map_off(block));
+            have = need;
+        }
+    }
+
+    if (have < need) {
+        if (packed && use_shadow()) return -EOPNOTSUPP;
+        blockidx_t new_block;
+        unsigned new_off;
+        int res = pack_alloc(entry_off, need, &new_block, &new_off);
+        if (res < 0) return res;
+        if (packed) {
+            char data[SFS_PACK_MAX];
+            disk_read(data, old_len, pack_map_off(block) + off);
+            disk_write(data, old_len, pack_map_off(new_block) + new_off);
+            pack_release(block, off, have);
+        }
+        block = new_block;
+        off = new_off;
+    }
+
+    if (len > old_len) zero_block_range(block, off + old_len, off + len);
+    entry->first_block = block;
+    entry->size = SFS_PACK_SIZE(off, len);
+    put_entry(entry, entry_off);
+    return 0;
+}
+
+// move a packed file into a chain of its own, one block as it is shorter
+// than that. refused with a shadowed table, as pack_resize refuses its move
+static int unpack_file(struct sfs_entry *entry, unsigned entry_off) {
+    if (use_shadow()) return -EOPNOTSUPP;
+    uint32_t len = SFS_PACK_LEN(entry->size);
+    char data[SFS_PACK_MAX];
+    disk_read(data, len, pack_data_off(entry));
+
+    blockidx_t block;
+    int got = allocate_head(entry_off, 1, &block);
+    if (got < 0) return got;
+    disk_write(data, len, SFS_DATA_OFF + block * SFS_BLOCK_SIZE);
+    zero_fresh_range(block, len, SFS_BLOCK_SIZE);
+    set_tail(block, block, 1);
+    pack_free(entry);
+
+    entry->first_block = block;
+    entry->size = len;
+    put_entry(entry, entry_off);
+    return 0;
+}
+
+// statfs slots per directory array. a packed array holds as many entries
+// as their names allow, it is counted as if all names were this long
+#define SFS_DIRREC_NOMINAL 12
+
+static unsigned dir_slots(void) {
+    return use_packdir() ? SFS_DIRREC_AREA / SFS_DIRREC_LEN(SFS_DIRREC_NOMINAL)
+                         : SFS_DIR_NENTRIES;
+}
+
+// find a free directory slot and return its offset
+static int find_free_entry(unsigned dir_off, unsigned num_entries, unsigned *ret_entry_off) {
+    struct sfs_entry entry;
+    for (unsigned i = 0; i < num_entries; i++) {
+        disk_read(&entry, sizeof(entry), dir_off + i * sizeof(struct sfs_entry));
+        if (strlen(entry.filename) == 0) {
+            *ret_entry_off = dir_off + i * sizeof(struct sfs_entry);
+            return 0;
+        }
+    }
+    return -ENOSPC;
+}
+
+// place a record in the first run of free records long enough for it. the
+// run is merged into one, the record takes its front and the rest stays
+// free unless it is too short to hold a name
+static int add_packed_entry(unsigned dir_off, const struct sfs_entry *entry) {
+    struct dir_scan scan;
+    dir_scan_start(&scan, dir_off, SFS_DIR_NENTRIES);
+
+    size_t name_len = strlen(entry->filename);
+    unsigned need = SFS_DIRREC_LEN(name_len);
+    struct sfs_entry curr;
+    unsigned curr_off;
+    while (dir_scan_next(&scan, &curr, &curr_off)) {
+        if (strlen(curr.filename) > 0) continue;
+        unsigned run_start = curr_off - dir_off, run_end = scan.pos;
+        while (dir_scan_next(&scan, &curr, &curr_off) && strlen(curr.filename) == 0)
+            run_end = scan.pos;
+        unsigned run = run_end - run_start;
+        if (run < need) continue;
+
+        char *p = scan.area + run_start;
+        struct sfs_dirrec rec = { .size = entry->size, .first_block = entry->first_block,
+                                  .name_len = (uint8_t)name_len };
+        rec.rec_len = run - need < SFS_DIRREC_LEN(1) ? run : need;
+        memset(p, 0, run);
+        memcpy(p, &rec, offsetof(struct sfs_dirrec, name));
+        memcpy(p + offsetof(struct sfs_dirrec, name), entry->filename, name_len);
+        if (rec.rec_len < run) {
+            struct sfs_dirrec rest = { .first_block = SFS_BLOCKIDX_EMPTY,
+                                       .rec_len = run - rec.rec_len };
+            memcpy(p + rec.rec_len, &rest, offsetof(struct sfs_dirrec, name));
+        }
+        disk_write(p, run, dir_off + run_start);
+        return 0;
+    }
+    return -ENOSPC;
+}
+
+// add a named entry to a directory array
+static int add_entry(unsigned dir_off, unsigned num_entries, const struct sfs_entry *entry) {
+    if (is_packed(dir_off)) return add_packed_entry(dir_off, entry);
+
+    unsigned entry_off;
+    int res = find_free_entry(dir_off, num_entries, &entry_off);
+    if (res < 0) return res;
+    put_entry(entry, entry_off);
+    return 0;
+}
+
+// free the slot or record at entry_off
+static void clear_entry(unsigned entry_off) {
+    lookup_drop(entry_off);
+    gen_bump(entry_off);
+    if (is_packed(entry_off)) {
+        uint8_t name_len = 0;
+        disk_write(&name_len, sizeof(name_len), entry_off + offsetof(struct sfs_dirrec, name_len));
+        return;
+    }
+    struct sfs_entry empty_entry = {0};
+    empty_entry.first_block = SFS_BLOCKIDX_EMPTY;
+    disk_write(&empty_entry, sizeof(empty_entry), entry_off);
+}
+
+// check whether a directory contains no named entries
+static int check_dir_empty(unsigned dir_off, unsigned num_entries) {
+    struct sfs_entry entry;
+    unsigned entry_off;
+    struct dir_scan scan;
+    dir_scan_start(&scan, dir_off, num_entries);
+    while (dir_scan_next(&scan, &entry, &entry_off))
+        if (strlen(entry.filename) > 0) return -ENOTEMPTY;
+    return 0;
+}
+
+// give a directory its entry array. the array is read in place, so its
+// blocks must be contiguous: one scan finds the whole run, one write links it
+// and one write initialises the array. the caller updates the entry
+static int alloc_dir_blocks(const char *path, unsigned entry_off, blockidx_t *first_block) {
+    int res = allocate_run(dir_goal(path, entry_off), SFS_HEAD_GAP, SFS_DIR_BLOCKS, first_block);
+    if (res < 0) return res;
+
+    blockidx_t links[SFS_DIR_BLOCKS];
+    for (unsigned i = 0; i + 1 < SFS_DIR_BLOCKS; i++) links[i] = *first_block + i + 1;
+    links[SFS_DIR_BLOCKS - 1] = SFS_BLOCKIDX_END;
+    table_write(links, SFS_DIR_BLOCKS, *first_block);
+
+    if (use_packdir()) {
+        // one free record over the whole array
+        char area[SFS_DIRREC_AREA] = {0};
+        struct sfs_dirrec rec = { .first_block = SFS_BLOCKIDX_EMPTY, .rec_len = SFS_DIRREC_AREA };
+        memcpy(area, &rec, offsetof(struct sfs_dirrec, name));
+        disk_write(area, sizeof(area), SFS_DATA_OFF + *first_block * SFS_BLOCK_SIZE);
+    } else {
+        struct sfs_entry empty_dir[SFS_DIR_NENTRIES];
+        memset(empty_dir, 0, sizeof(empty_dir));
+        for (unsigned i = 0; i < SFS_DIR_NENTRIES; i++)
+            empty_dir[i].first_block = SFS_BLOCKIDX_EMPTY;
+        disk_write(empty_dir, sizeof(empty_dir), SFS_DATA_OFF + *first_block * SFS_BLOCK_SIZE);
+    }
+
+    entry_slots += dir_slots();
+    return 0;
+}
+
+// locate the entry array of the directory at path. new directories have no
+// blocks (first_block is END) and report no slots; with allocate set their
+// array is created here, so only directories that receive entries use space
+static int get_dir_area(const char *path, int allocate, unsigned *dir_off,
+                        unsigned *num_entries) {
+    if (strcmp(path, "/") == 0) {
+        *dir_off = SFS_ROOTDIR_OFF;
+        *num_entries = SFS_ROOTDIR_NENTRIES;
+        return 0;
+    }
+
+    struct sfs_entry dir;
+    unsigned dir_entry_off;
+    int res = get_entry(path, &dir, &dir_entry_off);
+    if (res < 0) return res;
+    if (!(dir.size & SFS_DIRECTORY)) return -ENOTDIR;
+
+    if (dir.first_block == SFS_BLOCKIDX_END) {
+        if (!allocate) {
+            *dir_off = 0;
+            *num_entries = 0;
+            return 0;
+        }
+        blockidx_t first_block;
+        res = alloc_dir_blocks(path, dir_entry_off, &first_block);
+        if (res < 0) return res;
+        dir.first_block = first_block;
+        put_entry(&dir, dir_entry_off);
+    }
+
+    *dir_off = SFS_DATA_OFF + dir.first_block * SFS_BLOCK_SIZE;
+    *num_entries = SFS_DIR_NENTRIES;
+    return 0;
+}
+
+// mkdir creates a new directory entry, its blocks come with the first entry
+static int sfs_mkdir_locked(const char *path, mode_t mode) {
+    (void)mode;
+
+    char *last_slash = strrchr(path, '/');
+    if (!last_slash || strlen(last_slash + 1) >= SFS_FILENAME_MAX) return -ENAMETOOLONG;
+
+    // already exists
+    struct sfs_entry existing;
+    unsigned existing_off;
+    if (get_entry(path, &existing, &existing_off) == 0) return -EEXIST;
+
+    // locate parent, giving it blocks if this is its first entry
+    char *parent_path = strdup(path);
+    if (!parent_path) return -ENOMEM;
+    parent_path[last_slash - path] = '\0';
+    if (strlen(parent_path) == 0) strcpy(parent_path, "/");
+
+    unsigned parent_dir_off, num_entries;
+    int res = get_dir_area(parent_path, 1, &parent_dir_off, &num_entries);
+    free(parent_path);
+    if (res < 0) return res;
+
+    struct sfs_entry new_dir = {0};
+    strncpy(new_dir.filename, last_slash + 1, SFS_FILENAME_MAX - 1);
+    new_dir.first_block = SFS_BLOCKIDX_END; // no entries, no blocks
+    new_dir.size = SFS_DIRECTORY;
+
+    res = add_entry(parent_dir_off, num_entries, &new_dir);
+    if (res < 0) return res;
+    used_entries++;
+    return 0;
+}
+
+// rmdir removes an empty directory and frees its block chain
+static int sfs_rmdir_locked(const char *path) {
+    if (strcmp(path, "/") == 0) return -EBUSY;
+
+    struct sfs_entry entry;
+    unsigned entry_off;
+    int res = get_entry(path, &entry, &entry_off);
+    if (res < 0) return res;
+    if (!(entry.size & SFS_DIRECTORY)) return -ENOTDIR;
+
+    // a directory that never received an entry has no blocks
+    if (entry.first_block != SFS_BLOCKIDX_END) {
+        unsigned dir_off = SFS_DATA_OFF + entry.first_block * SFS_BLOCK_SIZE;
+        res = check_dir_empty(dir_off, SFS_DIR_NENTRIES);
+        if (res < 0) return res;
+
+        // free the chain
+        free_block_chain(entry.first_block);
+        entry_slots -= dir_slots();
+    }
+
+    // clear the directory entry in parent
+    clear_entry(entry_off);
+    used_entries--;
+
+    return 0;
+}
+
+// unlink removes a regular file, frees blocks, and clears its directory entry
+static int sfs_unlink_locked(const char *path) {
+    struct sfs_entry entry;
+    unsigned entry_off;
+    int res = get_entry(path, &entry, &entry_off);
+    if (res < 0) return res;
+    if (entry.size & SFS_DIRECTORY) return -EISDIR;
+
+    if (is_packed_file(&entry)) {
+        pack_free(&entry);
+    } else {
+        drop_skipidx(entry.first_block);
+        drop_tail(entry.first_block);
+        free_block_chain(entry.first_block);
+    }
+
+    clear_entry(entry_off);
+    used_entries--;
+    return 0;
+}
+
+// create makes an empty file entry in the parent directory
+static int sfs_create_locked(const char *path, mode_t mode, struct fuse_file_info *fi) {
+    (void)mode;
+    (void)fi;
+
+    char *last_slash = strrchr(path, '/');
+    if (!last_slash || strlen(last_slash + 1) >= SFS_FILENAME_MAX) return -ENAMETOOLONG;
+
+    struct sfs_entry existing;
+    unsigned existing_off;
+    if (get_entry(path, &existing, &existing_off) == 0) return -EEXIST;
+
+    // locate parent, giving it blocks if this is its first entry
+    char *parent_path = strdup(path);
     if (!parent_path) return -ENOMEM;
     parent_path[last_slash - path] = '\0';
     if (strlen(parent_path) == 0) strcpy(parent_path, "/");
 
-    struct sfs_entry parent;
-    unsigned parent_off;
-    int res = get_entry(parent_path, &parent, &parent_off);
-    if (res < 0) { free(parent_path); return res; }
-
-    unsigned parent_dir_off = (strcmp(parent_path, "/") == 0)
-        ? SFS_ROOTDIR_OFF
-        : SFS_DATA_OFF + parent.first_block * SFS_BLOCK_SIZE;
-    unsigned num_entries = (strcmp(parent_path, "/") == 0)
-        ? SFS_ROOTDIR_NENTRIES
-        : SFS_DIR_NENTRIES;
-    free(parent_path);
+    unsigned parent_dir_off, num_entries;
+    int res = get_dir_area(parent_path, 1, &parent_dir_off, &num_entries);
+    free(parent_path);
+    if (res < 0) return res;
+
+    struct sfs_entry new_file = {0};
+    strncpy(new_file.filename, last_slash + 1, SFS_FILENAME_MAX - 1);
+    new_file.first_block = SFS_BLOCKIDX_END; // empty file
+    new_file.size = 0;
+
+    res = add_entry(parent_dir_off, num_entries, &new_file);
+    if (res < 0) return res;
+    used_entries++;
+    return 0;
+}
+
+// open tells the kernel to keep the pages it cached for the file when it is
+// unchanged since its last open. a created file has none, so create leaves
+// keep_cache clear
+static int sfs_open_locked(const char *path, struct fuse_file_info *fi) {
+    struct sfs_entry entry;
+    unsigned entry_off;
+    int res = get_entry(path, &entry, &entry_off);
+    if (res < 0) return res;
+    if (entry.size & SFS_DIRECTORY) return -EISDIR;
+    fi->keep_cache = gen_open(entry_off);
+    return 0;
+}
+
+// read copies up to size bytes from offset, respects end of file
+static int sfs_read_locked(const char *path, char *buf, size_t size, off_t offset,
+                           struct fuse_file_info *fi) {
+    (void)fi;
+
+    struct sfs_entry entry;
+    unsigned entry_off;
+    int res = get_entry(path, &entry, &entry_off);
+    if (res < 0) return res;
+    if (entry.size & SFS_DIRECTORY) return -EISDIR;
+
+    uint32_t file_size = file_size_of(&entry);
+    if (offset >= file_size) return 0;
+
+    if (offset + size > file_size) size = file_size - offset;
+
+    if (is_packed_file(&entry)) {
+        disk_read(buf, size, pack_data_off(&entry) + offset);
+        return (int)size;
+    }
+
+    unsigned bytes_read = 0;
+    off_t current_offset = offset % SFS_BLOCK_SIZE;
+
+    // skip full blocks to reach starting offset. a chain may end before the
+    // size does, past its end the file reads as zeros
+    unsigned reached = 0;
+    blockidx_t current_block = SFS_BLOCKIDX_END;
+    if (entry.first_block != SFS_BLOCKIDX_END)
+        current_block = chain_seek(entry.first_block, offset / SFS_BLOCK_SIZE,
+                                   (file_size + SFS_BLOCK_SIZE - 1) / SFS_BLOCK_SIZE, &reached);
+    if (current_block == SFS_BLOCKIDX_END || reached < offset / SFS_BLOCK_SIZE) {
+        memset(buf, 0, size);
+        return (int)size;
+    }
+
+    // read from the chain
+    while (bytes_read < size) {
+        unsigned block_offset = current_offset;
+        unsigned can_read = SFS_BLOCK_SIZE - block_offset;
+        if (can_read > size - bytes_read) can_read = size - bytes_read;
+
+        disk_read(buf + bytes_read, can_read,
+                  SFS_DATA_OFF + current_block * SFS_BLOCK_SIZE + block_offset);
+
+        bytes_read += can_read;
+        current_offset = 0;
+
+        if (bytes_read < size) {
+            blockidx_t next_block;
+            table_read(&next_block, 1, current_block);
+            if (next_block == SFS_BLOCKIDX_END) {
+                memset(buf + bytes_read, 0, size - bytes_read);
+                bytes_read = size;
+                break;
+            }
+            current_block = next_block;
+        }
+    }
+
+    return (int)bytes_read;
+}
+
+// truncate grows or shrinks a file to the requested size
+static int sfs_truncate_locked(const char *path, off_t size) {
+    if (size < 0) return -EINVAL;
+    if ((unsigned)size > max_file_size()) return -EFBIG;
+
+    struct sfs_entry entry;
+    unsigned entry_off;
+    int res = get_entry(path, &entry, &entry_off);
+    if (res < 0) return res;
+    if (entry.size & SFS_DIRECTORY) return -EISDIR;
+    gen_bump(entry_off);
+
+    // a packed file resizes in its pack block, or leaves it to grow
+    if (is_packed_file(&entry)) {
+        if (size == 0) {
+            pack_free(&entry);
+            entry.first_block = SFS_BLOCKIDX_END;
+            entry.size = 0;
+            put_entry(&entry, entry_off);
+            return 0;
+        }
+        if (size < SFS_PACK_MAX) return pack_resize(&entry, entry_off, size);
+        res = unpack_file(&entry, entry_off);
+        if (res < 0) return res;
+    }
+
+    uint32_t current_size = entry.size & SFS_SIZEMASK;
+
+    if (size < (off_t)current_size) {
+        // shrink
+        blockidx_t current_block = entry.first_block;
+        blockidx_t last_kept = SFS_BLOCKIDX_END;
+        off_t blocks_needed = (size + SFS_BLOCK_SIZE - 1) / SFS_BLOCK_SIZE;
+
+        while (blocks_needed > 0 && current_block != SFS_BLOCKIDX_END) {
+            blockidx_t next_block;
+            table_read(&next_block, 1, current_block);
+            blocks_needed--;
+            last_kept = current_block;
+            current_block = next_block;
+        }
+
+        // short chains go without a skip index
+        off_t blocks_kept = (size + SFS_BLOCK_SIZE - 1) / SFS_BLOCK_SIZE - blocks_needed;
+        if (blocks_kept <= SFS_SKIP_STRIDE) drop_skipidx(entry.first_block);
+        else skip_cut(entry.first_block, blocks_kept);
+        if (last_kept != SFS_BLOCKIDX_END) set_tail(entry.first_block, last_kept, blocks_kept);
+
+        if (current_block != SFS_BLOCKIDX_END) {
+            // terminate the kept part before releasing the rest
+            if (last_kept == SFS_BLOCKIDX_END) {
+                drop_tail(entry.first_block);
+                entry.first_block = SFS_BLOCKIDX_END;
+            } else {
+                blockidx_t end_marker = SFS_BLOCKIDX_END;
+                table_write(&end_marker, 1, last_kept);
+            }
+            free_block_chain(current_block);
+        }
+
+        // keep the cut off part of the last block zero for a later grow. a
+        // chain that ends before the new size has no block there
+        if (last_kept != SFS_BLOCKIDX_END && blocks_needed == 0 && size % SFS_BLOCK_SIZE)
+            zero_block_range(last_kept, size % SFS_BLOCK_SIZE, SFS_BLOCK_SIZE);
+    } else if (size > (off_t)current_size) {
+        // grow, the slack of the current tail is zero already
+        blockidx_t current_block = entry.first_block;
+        off_t blocks_have = 0;
+        off_t blocks_needed = (size + SFS_BLOCK_SIZE - 1) / SFS_BLOCK_SIZE;
+
+        // start from the recorded tail when there is one, else walk to it
+        blockidx_t tail;
+        unsigned tail_count;
+        if (get_tail(current_block, &tail, &tail_count)) {
+            current_block = tail;
+            blocks_have = tail_count;
+        } else if (current_block != SFS_BLOCKIDX_END) {
+            blocks_have = 1;
+            for (;;) {
+                blockidx_t next_block;
+                table_read(&next_block, 1, current_block);
+                if (next_block == SFS_BLOCKIDX_END) break;
+                current_block = next_block;
+                blocks_have++;
+            }
+        }
+
+        while (blocks_have < blocks_needed) {
+            blockidx_t new_block;
+            int got;
+            // the rest of the growth in as few runs as the allocator finds
+            if (blocks_have == 0) {
+                got = allocate_head(entry_off, blocks_needed, &new_block);
+                if (got < 0) { res = got; break; }
+                entry.first_block = new_block;
+            } else {
+                got = allocate_extent(current_block + 1, blocks_needed - blocks_have, &new_block);
+                if (got < 0) { res = got; break; }
+            }
+            for (int i = 0; i < got; i++) zero_fresh_range(new_block + i, 0, SFS_BLOCK_SIZE);
+            if (blocks_have > 0) link_extent(current_block, new_block, got);
+            skip_note(entry.first_block, blocks_have, new_block, got);
+
+            current_block = new_block + got - 1;
+            blocks_have += got;
+        }
+        if (blocks_have > 0) set_tail(entry.first_block, current_block, blocks_have);
+
+        // out of space: keep the blocks already linked, leave the size alone
+        if (res < 0) {
+            put_entry(&entry, entry_off);
+            return res;
+        }
+    }
+
+    entry.size = (uint32_t)size;
+    put_entry(&entry, entry_off);
+    return 0;
+}
+
+// keep trailing zeros of writes past the end of a chain as a hole instead of
+// allocating blocks for them (set by main)
+static int zero_detect;
+
+// length of buf up to the end of the last file block that holds a non zero
+// byte. blocks are compared with memcmp against a zero block, which the C
+// library vectorises
+static size_t nonzero_len(const char *buf, size_t size, off_t offset) {
+    static const char zeros[SFS_BLOCK_SIZE];
+    size_t len = size;
+    while (len > 0) {
+        off_t block_start = (offset + (off_t)len - 1) / SFS_BLOCK_SIZE * SFS_BLOCK_SIZE;
+        size_t from = block_start > offset ? (size_t)(block_start - offset) : 0;
+        if (memcmp(buf + from, zeros, len - from) != 0) break;
+        len = from;
+    }
+    return len;
+}
+
+// raise the recorded size of a file to end if it is below it
+static void extend_size(struct sfs_entry *entry, unsigned entry_off, off_t end) {
+    if (end <= (off_t)(entry->size & SFS_SIZEMASK)) return;
+    entry->size = (uint32_t)end;
+    put_entry(entry, entry_off);
+}
+
+// write copies from buf to file, grows the chain if needed, returns bytes written
+static int sfs_write_locked(const char *path, const char *buf, size_t size,
+                            off_t offset, struct fuse_file_info *fi) {
+    (void)fi;
+
+    struct sfs_entry entry;
+    unsigned entry_off;
+    int res = get_entry(path, &entry, &entry_off);
+    if (res < 0) return res;
+    if (entry.size & SFS_DIRECTORY) return -EISDIR;
+    if (offset + size > max_file_size()) return -EFBIG;
+    gen_bump(entry_off);
+
+    // small files go to a pack block: a packed file while it stays below
+    // SFS_PACK_MAX, an empty one when the write leaves it there. a shadowed
+    // table packs no new files, which could not move out again
+    int pack = is_packed_file(&entry) ||
+               (use_smallfile() && !use_shadow() && entry.first_block == SFS_BLOCKIDX_END &&
+                entry.size == 0);
+    if (pack && offset + size < SFS_PACK_MAX) {
+        if (size == 0) return 0;
+        if (offset + size > file_size_of(&entry)) {
+            res = pack_resize(&entry, entry_off, offset + size);
+            if (res < 0) return res;
+        }
+        disk_write(buf, size, pack_data_off(&entry) + offset);
+        return (int)size;
+    }
+    if (is_packed_file(&entry)) {
+        res = unpack_file(&entry, entry_off);
+        if (res < 0) return res;
+    }
+
+    // only the first data_len bytes need storing where the chain has to grow,
+    // the zeros after them read back the same from a hole
+    size_t data_len = zero_detect ? nonzero_len(buf, size, offset) : size;
+
+    // blocks allocated by this call are fresh: the parts the write does not
+    // cover are zeroed, everything else already reads as zero past the end.
+    // counts the fresh blocks from the current one on
+    unsigned fresh = 0;
+
+    // new tail of the chain once this call links blocks at its end, recorded
+    // once before returning
+    blockidx_t new_tail = SFS_BLOCKIDX_END;
+    unsigned new_count = 0;
+
+    // the entry needs writing back: a new first block, or the size grew
+    int entry_dirty = 0;
+
+    // ensure there is at least a first block, a write from the start of the
+    // file may take its whole extent at once
+    if (entry.first_block == SFS_BLOCKIDX_END) {
+        if (data_len == 0) {
+            extend_size(&entry, entry_off, offset + size);
+            return (int)size;
+        }
+        unsigned want = offset == 0 ? (data_len + SFS_BLOCK_SIZE - 1) / SFS_BLOCK_SIZE : 1;
+        blockidx_t new_block;
+        int got = allocate_head(entry_off, want, &new_block);
+        if (got < 0) return got;
+        entry.first_block = new_block;
+        entry_dirty = 1;
+        skip_note(new_block, 0, new_block, got);
+        fresh = got;
+        new_tail = new_block + got - 1;
+        new_count = got;
+    }
+
+    // walk to the block that contains the starting offset, or the tail. an
+    // append starts right at the recorded tail
+    unsigned reached;
+    blockidx_t current_block;
+    blockidx_t tail;
+    unsigned tail_count;
+    uint32_t file_size = entry.size & SFS_SIZEMASK;
+    if (!fresh && get_tail(entry.first_block, &tail, &tail_count) &&
+        offset / SFS_BLOCK_SIZE + 1 >= tail_count) {
+        current_block = tail;
+        reached = tail_count - 1;
+    } else {
+        current_block = chain_seek(entry.first_block, offset / SFS_BLOCK_SIZE,
+                                   (file_size + SFS_BLOCK_SIZE - 1) / SFS_BLOCK_SIZE, &reached);
+    }
+    off_t current_offset = (off_t)reached * SFS_BLOCK_SIZE;
+
+    // only zeros to write past the end of the chain: the gap stays a hole
+    if (current_offset + SFS_BLOCK_SIZE <= offset && data_len == 0) {
+        extend_size(&entry, entry_off, offset + size);
+        return (int)size;
+    }
+
+    // if we need to step through empty space to reach offset
+    while (current_offset + SFS_BLOCK_SIZE <= offset) {
+        if (fresh) zero_fresh_range(current_block, 0, SFS_BLOCK_SIZE);
+
+        blockidx_t new_block;
+        res = allocate_block(current_block + 1, 0, &new_block);
+        if (res < 0) {
+            if (new_tail != SFS_BLOCKIDX_END) set_tail(entry.first_block, new_tail, new_count);
+            if (entry_dirty) put_entry(&entry, entry_off);
+            return res;
+        }
+
+        table_write(&new_block, 1, current_block);
+        blockidx_t end_marker = SFS_BLOCKIDX_END;
+        table_write(&end_marker, 1, new_block);
+        skip_note(entry.first_block, current_offset / SFS_BLOCK_SIZE + 1, new_block, 1);
+        new_tail = new_block;
+        new_count = current_offset / SFS_BLOCK_SIZE + 2;
+
+        current_block = new_block;
+        current_offset += SFS_BLOCK_SIZE;
+        fresh = 1;
+    }
+
+    // write data across blocks
+    size_t written = 0;
+    while (written < size) {
+        size_t block_off = offset + written - current_offset;
+        size_t can_write = SFS_BLOCK_SIZE - block_off;
+        if (can_write > size - written) can_write = size - written;
+
+        if (fresh) {
+            zero_fresh_range(current_block, 0, block_off);
+            zero_fresh_range(current_block, block_off + can_write, SFS_BLOCK_SIZE);
+        }
+        disk_write(buf + written, can_write,
+                   SFS_DATA_OFF + current_block * SFS_BLOCK_SIZE + block_off);
+
+        written += can_write;
+
+        if (written < size) {
+            blockidx_t next_block;
+            table_read(&next_block, 1, current_block);
+
+            if (fresh > 0) fresh--;
+            if (next_block == SFS_BLOCKIDX_END) {
+                // the rest is zeros past the end of the chain, a hole
+                if (written >= data_len) {
+                    written = size;
+                    break;
+                }
+                // extend by everything the rest of the write needs at once
+                unsigned want = (data_len - written + SFS_BLOCK_SIZE - 1) / SFS_BLOCK_SIZE;
+                int got = allocate_extent(current_block + 1, want, &next_block);
+                if (got < 0) break;
+                link_extent(current_block, next_block, got);
+                skip_note(entry.first_block, current_offset / SFS_BLOCK_SIZE + 1, next_block, got);
+                fresh = got;
+                new_tail = next_block + got - 1;
+                new_count = current_offset / SFS_BLOCK_SIZE + 1 + got;
+            }
+
+            current_block = next_block;
+            current_offset += SFS_BLOCK_SIZE;
+        }
+    }
+
+    if (new_tail != SFS_BLOCKIDX_END) set_tail(entry.first_block, new_tail, new_count);
+
+    // update file size if we extended
+    if (offset + written > (entry.size & SFS_SIZEMASK)) {
+        entry.size = (uint32_t)(offset + written);
+        entry_dirty = 1;
+    }
+    if (entry_dirty) put_entry(&entry, entry_off);
+    return (int)written;
+}
+
+// fallocate preallocates by growing the file through truncate, which takes
+// the new blocks as runs. a file is always backed up to its size, so only
+// mode 0 is meaningful here
+static int sfs_fallocate_locked(const char *path, int mode, off_t offset, off_t len,
+                                struct fuse_file_info *fi) {
+    (void)fi;
+    if (mode != 0) return -EOPNOTSUPP;
+    if (offset < 0 || len <= 0) return -EINVAL;
+
+    struct sfs_entry entry;
+    unsigned entry_off;
+    int res = get_entry(path, &entry, &entry_off);
+    if (res < 0) return res;
+    if (entry.size & SFS_DIRECTORY) return -EISDIR;
+
+    if (offset + len <= (off_t)file_size_of(&entry)) return 0;
+    return sfs_truncate_locked(path, offset + len);
+}
+
+// defrag tuning: most chain positions moved per locked step, and the pause in
+// seconds between background passes over the tree
+#define SFS_DEFRAG_STEP 256
+#define SFS_DEFRAG_IDLE 60
+
+// background defrag rate in blocks per second, 0 disables it (set by main)
+static unsigned defrag_rate;
+
+// serialises the callbacks against the background defragmenter
+static pthread_mutex_t fs_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static pthread_t defrag_thread;
+static pthread_mutex_t defrag_wait_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t defrag_wake = PTHREAD_COND_INITIALIZER;
+static int defrag_running;
+
+// range locks. a write that only overwrites blocks a file already has, inside
+// its size, registers its byte range here and copies the data with fs_lock
+// dropped, so writers to different parts of a file, or different files, run
+// in parallel. the disk layer does positioned IO, so those writes need no
+// lock of their own. anything that allocates, links or changes a size still
+// runs under fs_lock, and waits first for in flight ranges it overlaps;
+// truncate, unlink and defrag wait for the whole file, as they free or move
+// its blocks
+#define SFS_RANGE_SLOTS 64
+
+// largest read or write the kernel is asked to send in one request. the
+// kernel and the library cut it down to what they support; main passes the
+// same value as the max_read mount option, which bounds reads
+#define SFS_MAX_REQUEST (1u << 20)
+
+// most blocks one unlocked write may cover, a whole request at any offset
+#define SFS_RANGE_BLOCKS (SFS_MAX_REQUEST / SFS_BLOCK_SIZE + 1)
+
+struct range_lock {
+    int held;
+    unsigned entry_off;
+    off_t start, end;
+};
+
+static struct range_lock ranges[SFS_RANGE_SLOTS];
+static unsigned ranges_held;
+static pthread_cond_t range_done = PTHREAD_COND_INITIALIZER;
+
+static int range_busy(unsigned entry_off, off_t start, off_t end) {
+    if (ranges_held == 0) return 0;
+    for (unsigned i = 0; i < SFS_RANGE_SLOTS; i++) {
+        if (ranges[i].held && ranges[i].entry_off == entry_off && ranges[i].start < end &&
+            start < ranges[i].end)
+            return 1;
+    }
+    return 0;
+}
+
+// wait until no write holds a range of path's file overlapping [start, end).
+// fs_lock is dropped while waiting, so the caller looks the entry up after
+// this returns. caller holds fs_lock
+static void wait_ranges(const char *path, off_t start, off_t end) {
+    while (ranges_held > 0) {
+        struct sfs_entry entry;
+        unsigned entry_off;
+        if (get_entry(path, &entry, &entry_off) < 0) return;
+        if (!range_busy(entry_off, start, end)) return;
+        pthread_cond_wait(&range_done, &fs_lock);
+    }
+}
+
+static void wait_file(const char *path) {
+    wait_ranges(path, 0, (off_t)SFS_SIZEMASK + 1);
+}
+
+// overwrite existing blocks of a file with fs_lock dropped. the blocks are
+// collected and the range registered under the lock, which is retaken to
+// release it. returns -EAGAIN when the write has to take the locked path:
+// it grows the file, meets a hole, is packed or too large, or no slot or
+// memory for the block list is free. caller holds fs_lock
+static int write_in_place(const char *path, const char *buf, size_t size, off_t offset) {
+    struct sfs_entry entry;
+    unsigned entry_off;
+    int res;
+    for (;;) {
+        res = get_entry(path, &entry, &entry_off);
+        if (res < 0) return res;
+        if (!range_busy(entry_off, offset, offset + size)) break;
+        pthread_cond_wait(&range_done, &fs_lock);
+    }
+    if (entry.size & SFS_DIRECTORY) return -EISDIR;
+    if (size == 0 || is_packed_file(&entry) || entry.first_block == SFS_BLOCKIDX_END ||
+        offset + size > (entry.size & SFS_SIZEMASK))
+        return -EAGAIN;
+
+    unsigned first = offset / SFS_BLOCK_SIZE;
+    unsigned count = (offset + size - 1) / SFS_BLOCK_SIZE - first + 1;
+    if (count > SFS_RANGE_BLOCKS) return -EAGAIN;
+
+    unsigned slot = 0;
+    while (slot < SFS_RANGE_SLOTS && ranges[slot].held) slot++;
+    if (slot == SFS_RANGE_SLOTS) return -EAGAIN;
+
+    blockidx_t *blocks = malloc(count * sizeof(blockidx_t));
+    if (!blocks) return -EAGAIN;
+    unsigned reached;
+    uint32_t file_size = entry.size & SFS_SIZEMASK;
+    blocks[0] = chain_seek(entry.first_block, first,
+                           (file_size + SFS_BLOCK_SIZE - 1) / SFS_BLOCK_SIZE, &reached);
+    int mapped = reached == first;
+    for (unsigned i = 1; i < count && mapped; i++) {
+        table_read(&blocks[i], 1, blocks[i - 1]);
+        mapped = blocks[i] != SFS_BLOCKIDX_END;
+    }
+    if (!mapped) {
+        free(blocks);
+        return -EAGAIN;
+    }
+    gen_bump(entry_off);
+    ranges[slot].held = 1;
+    ranges[slot].entry_off = entry_off;
+    ranges[slot].start = offset;
+    ranges[slot].end = offset + size;
+    ranges_held++;
+    pthread_mutex_unlock(&fs_lock);
+
+    // one disk write per contiguous run of blocks
+    size_t written = 0;
+    size_t block_off = offset % SFS_BLOCK_SIZE;
+    for (unsigned i = 0; i < count;) {
+        unsigned run = 1;
+        while (i + run < count && blocks[i + run] == blocks[i] + run) run++;
+        size_t len = (size_t)run * SFS_BLOCK_SIZE - block_off;
+        if (len > size - written) len = size - written;
+        disk_write(buf + written, len, SFS_DATA_OFF + blocks[i] * SFS_BLOCK_SIZE + block_off);
+        written += len;
+        block_off = 0;
+        i += run;
+    }
+
+    free(blocks);
+
+    pthread_mutex_lock(&fs_lock);
+    ranges[slot].held = 0;
+    ranges_held--;
+    pthread_cond_broadcast(&range_done);
+    return (int)size;
+}
+
+// move up to max_blocks chain positions of a file, starting at start, into one
+// contiguous run right behind the block before them. the link into the segment
+// is written last, so a crash leaves either the old or the new segment in the
+// chain. returns the blocks moved and sets next to the position to resume at,
+// 0 once the end of the chain is reached. caller holds fs_lock
+static int defrag_step(const char *path, unsigned start, unsigned max_blocks,
+                       unsigned *next) {
+    struct sfs_entry entry;
+    unsigned entry_off;
+    int res = get_entry(path, &entry, &entry_off);
+    if (res < 0) return res;
+    if (entry.size & SFS_DIRECTORY) return -EISDIR;
+
+    *next = 0;
+    if (is_packed_file(&entry)) return 0; // shares its block
+    if (max_blocks == 0 || max_blocks > SFS_DEFRAG_STEP) max_blocks = SFS_DEFRAG_STEP;
+    // a new first block would reach the entry on disk before the commit that
+    // links it, so a shadowed table keeps the first block where it is
+    if (start == 0 && use_shadow()) start = 1;
+
+    // walk to the block before the segment
+    blockidx_t prev_block = SFS_BLOCKIDX_END;
+    blockidx_t current_block = entry.first_block;
+    for (unsigned i = 0; i < start && current_block != SFS_BLOCKIDX_END; i++) {
+        prev_block = current_block;
+        table_read(&current_block, 1, prev_block);
+    }
+    if (current_block == SFS_BLOCKIDX_END) return 0;
+
+    // collect the segment and count the breaks in it, including the link in
+    blockidx_t segment[SFS_DEFRAG_STEP];
+    unsigned count = 0;
+    unsigned breaks = prev_block != SFS_BLOCKIDX_END && current_block != prev_block + 1;
+    while (count < max_blocks && current_block != SFS_BLOCKIDX_END) {
+        if (count > 0 && current_block != segment[count - 1] + 1) breaks++;
+        segment[count++] = current_block;
+        table_read(&current_block, 1, segment[count - 1]);
+    }
+    blockidx_t after_block = current_block;
+    if (after_block != SFS_BLOCKIDX_END) *next = start + count;
+    if (breaks == 0) return 0;
+
+    // only move when the new run actually has fewer breaks than the old one
+    blockidx_t goal = prev_block != SFS_BLOCKIDX_END ? prev_block + 1 : entry_goal(entry_off);
+    blockidx_t run = pick_free_run(goal, 0, count);
+    if (run == SFS_BLOCKIDX_EMPTY) return 0;
+    if (prev_block != SFS_BLOCKIDX_END && run != prev_block + 1 && breaks == 1) return 0;
+
+    char *data = malloc((size_t)count * SFS_BLOCK_SIZE);
+    if (!data) return -ENOMEM;
+    claim_run(run, count);
+
+    // copy the data, reading contiguous pieces of the old segment in one go
+    for (unsigned i = 0; i < count; ) {
+        unsigned n = 1;
+        while (i + n < count && segment[i + n] == segment[i] + n) n++;
+        disk_read(data + i * SFS_BLOCK_SIZE, n * SFS_BLOCK_SIZE,
+                  SFS_DATA_OFF + segment[i] * SFS_BLOCK_SIZE);
+        i += n;
+    }
+    disk_write(data, (size_t)count * SFS_BLOCK_SIZE, SFS_DATA_OFF + run * SFS_BLOCK_SIZE);
+    free(data);
+
+    // link the new run and hook it onto the rest of the old chain
+    blockidx_t links[SFS_DEFRAG_STEP];
+    for (unsigned i = 0; i + 1 < count; i++) links[i] = run + i + 1;
+    links[count - 1] = after_block;
+    table_write(links, count, run);
+
+    // swap the new run in, a new first block takes the skip index and the
+    // tail reference along. whatever reference run had from an old chain is
+    // overwritten, and the old first block's is dropped with it
+    blockidx_t tail;
+    unsigned tail_count;
+    int has_tail = get_tail(entry.first_block, &tail, &tail_count);
+    if (prev_block == SFS_BLOCKIDX_END) {
+        entry.first_block = run;
+        put_entry(&entry, entry_off);
+        if (use_skipidx()) {
+            set_skipidx(run, get_skipidx(segment[0]));
+            set_skipidx(segment[0], SFS_BLOCKIDX_EMPTY);
+        }
+        drop_tail(segment[0]);
+    } else {
+        table_write(&run, 1, prev_block);
+    }
+    skip_note(entry.first_block, start, run, count);
+    if (after_block == SFS_BLOCKIDX_END)
+        set_tail(entry.first_block, run + count - 1, start + count);
+    else if (prev_block == SFS_BLOCKIDX_END && has_tail) set_tail(run, tail, tail_count);
+    else if (prev_block == SFS_BLOCKIDX_END) drop_tail(run);
+
+    // release the old segment, the same number of blocks the run took
+    for (unsigned i = 0; i < count; i++) links[i] = SFS_BLOCKIDX_EMPTY;
+    for (unsigned i = 0; i < count; ) {
+        unsigned n = 1;
+        while (i + n < count && segment[i + n] == segment[i] + n) n++;
+        table_write(links, n, segment[i]);
+        i += n;
+    }
+    for (unsigned i = 0; i < count; i++) release_block(segment[i]);
+
+    return (int)count;
+}
+
+static int defrag_should_run(void) {
+    pthread_mutex_lock(&defrag_wait_lock);
+    int running = defrag_running;
+    pthread_mutex_unlock(&defrag_wait_lock);
+    return running;
+}
+
+// sleep long enough to keep the defragmenter at defrag_rate blocks per second,
+// wakes up early when the file system is unmounted
+static void defrag_pause(unsigned blocks) {
+    struct timespec until;
+    clock_gettime(CLOCK_REALTIME, &until);
+    unsigned long long ns = (unsigned long long)blocks * 1000000000ull / defrag_rate;
+    until.tv_sec += ns / 1000000000ull + (until.tv_nsec + ns % 1000000000ull) / 1000000000ull;
+    until.tv_nsec = (until.tv_nsec + ns % 1000000000ull) % 1000000000ull;
+
+    pthread_mutex_lock(&defrag_wait_lock);
+    while (defrag_running &&
+           pthread_cond_timedwait(&defrag_wake, &defrag_wait_lock, &until) == 0) {
+    }
+    pthread_mutex_unlock(&defrag_wait_lock);
+}
 
-    unsigned new_entry_off;
-    res = find_free_entry(parent_dir_off, num_entries, &new_entry_off);
-    if (res < 0) return res;
+// defrag one file, a locked step at a time so foreground calls get in between
+static void defrag_file(const char *path) {
+    unsigned start = 0;
+    do {
+        unsigned next;
+        pthread_mutex_lock(&fs_lock);
+        wait_file(path);
+        int moved = defrag_step(path, start, SFS_DEFRAG_STEP, &next);
+        pthread_mutex_unlock(&fs_lock);
+        if (moved < 0) return;
+        if (moved > 0) defrag_pause(moved);
+        start = next;
+    } while (start != 0 && defrag_should_run());
+}
 
-    struct sfs_entry new_file = {0};
-    strncpy(new_file.filename, last_slash + 1, SFS_FILENAME_MAX - 1);
-    new_file.first_block = SFS_BLOCKIDX_END; // empty file
-    new_file.size = 0;
+// walk a directory tree and defrag every file in it. the directory array is
+// copied under the lock and every file is looked up again by path, so entries
+// that change while the walk is paused are never acted on stale
+static void defrag_tree(const char *dir_path) {
+    unsigned num_entries = strcmp(dir_path, "/") == 0 ? SFS_ROOTDIR_NENTRIES : SFS_DIRREC_MAX;
+    struct sfs_entry *entries = malloc(num_entries * sizeof(struct sfs_entry));
+    struct dir_scan *scan = malloc(sizeof(*scan));
+    if (!entries || !scan) {
+        free(entries);
+        free(scan);
+        return;
+    }
 
-    disk_write(&new_file, sizeof(new_file), new_entry_off);
-    return 0;
+    pthread_mutex_lock(&fs_lock);
+    unsigned dir_off, entry_off, count = 0;
+    if (get_dir_area(dir_path, 0, &dir_off, &num_entries) < 0) num_entries = 0;
+    dir_scan_start(scan, dir_off, num_entries);
+    while (dir_scan_next(scan, &entries[count], &entry_off)) count++;
+    pthread_mutex_unlock(&fs_lock);
+    free(scan);
+    num_entries = count;
+
+    size_t dir_len = strcmp(dir_path, "/") == 0 ? 0 : strlen(dir_path);
+    char *child = malloc(dir_len + SFS_FILENAME_MAX + 1);
+    for (unsigned i = 0; child && i < num_entries && defrag_should_run(); i++) {
+        if (strlen(entries[i].filename) == 0) continue;
+        memcpy(child, dir_path, dir_len);
+        child[dir_len] = '/';
+        strncpy(child + dir_len + 1, entries[i].filename, SFS_FILENAME_MAX - 1);
+        child[dir_len + SFS_FILENAME_MAX] = '\0';
+
+        if (entries[i].size & SFS_DIRECTORY) defrag_tree(child);
+        else defrag_file(child);
+    }
+
+    free(child);
+    free(entries);
 }
 
-// truncate grows or shrinks a file to the requested size
-static int sfs_truncate(const char *path, off_t size) {
-    if (size < 0) return -EINVAL;
-    if ((unsigned)size > SFS_SIZEMASK) return -EFBIG;
+static void *defrag_main(void *arg) {
+    (void)arg;
+    while (defrag_should_run()) {
+        defrag_tree("/");
+        defrag_pause(defrag_rate * SFS_DEFRAG_IDLE);
+    }
+    return NULL;
+}
 
-    struct sfs_entry entry;
-    unsigned entry_off;
-    int res = get_entry(path, &entry, &entry_off);
-    if (res < 0) return res;
-    if (entry.size & SFS_DIRECTORY) return -EISDIR;
+static pthread_t punch_thread;
+static int punch_running;
 
-    uint32_t current_size = entry.size & SFS_SIZEMASK;
+// take a run of free blocks away from the allocator while it is punched
+static void punch_take(blockidx_t first, unsigned len) {
+    for (unsigned b = first; b < first + len; b++) {
+        punch_busy[b / 8] |= 1u << (b % 8);
+        if (use_freelist()) freelist_remove(b);
+    }
+    if (buddy_enabled) buddy_take(first, len);
+}
 
-    if (size < (off_t)current_size) {
-        // shrink
-        blockidx_t current_block = entry.first_block;
-        off_t blocks_needed = (size + SFS_BLOCK_SIZE - 1) / SFS_BLOCK_SIZE;
+// give a run taken by punch_take back, marked punched when the punch went through
+static void punch_return(blockidx_t first, unsigned len, int done) {
+    for (unsigned b = first; b < first + len; b++) {
+        punch_busy[b / 8] &= ~(1u << (b % 8));
+        if (done) punched[b / 8] |= 1u << (b % 8);
+        if (use_freelist()) freelist_push(b);
+    }
+    if (buddy_enabled) buddy_free_range(first, len);
+}
 
-        while (blocks_needed > 0 && current_block != SFS_BLOCKIDX_END) {
-            blockidx_t next_block;
-            disk_read(&next_block, sizeof(next_block),
-                      SFS_BLOCKTBL_OFF + current_block * sizeof(blockidx_t));
-            blocks_needed--;
-            current_block = next_block;
+// punch the queued ranges out of the image file. the queue is taken as it
+// stands; a chunk at a time, the blocks of a range that are still free are
+// taken from the allocator under fs_lock, punched with the lock dropped and
+// given back once it is held again. called with fs_lock held
+static void punch_pending(void) {
+    struct punch_range ranges[SFS_PUNCH_QUEUE];
+    unsigned nranges = punch_queued;
+    memcpy(ranges, punch_queue, nranges * sizeof(ranges[0]));
+    punch_queued = 0;
+
+    for (unsigned q = 0; q < nranges && punching; q++) {
+        unsigned block = ranges[q].first, end = block + ranges[q].len;
+        while (block < end && punching) {
+            blockidx_t chunk[SFS_SCAN_CHUNK];
+            unsigned n = end - block < SFS_SCAN_CHUNK ? end - block : SFS_SCAN_CHUNK;
+            table_read(chunk, n, block);
+
+            struct punch_range runs[SFS_SCAN_CHUNK / 2 + 1];
+            int done[SFS_SCAN_CHUNK / 2 + 1];
+            unsigned nruns = 0, i = 0;
+            while (i < n) {
+                if (chunk[i] != SFS_BLOCKIDX_EMPTY || is_held(block + i)) { i++; continue; }
+                unsigned run = i;
+                while (i < n && chunk[i] == SFS_BLOCKIDX_EMPTY && !is_held(block + i)) i++;
+                runs[nruns].first = block + run;
+                runs[nruns].len = i - run;
+                punch_take(runs[nruns].first, runs[nruns].len);
+                nruns++;
+            }
+
+            pthread_mutex_unlock(&fs_lock);
+            int unsupported = 0;
+            for (unsigned r = 0; r < nruns; r++) {
+                done[r] = !unsupported &&
+                          fallocate(image_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                                    SFS_DATA_OFF + (off_t)runs[r].first * SFS_BLOCK_SIZE,
+                                    (off_t)runs[r].len * SFS_BLOCK_SIZE) == 0;
+                if (!done[r] && errno == EOPNOTSUPP) unsupported = 1;
+            }
+            pthread_mutex_lock(&fs_lock);
+
+            for (unsigned r = 0; r < nruns; r++)
+                punch_return(runs[r].first, runs[r].len, done[r]);
+            // the host file system has no holes, stop queueing
+            if (unsupported) {
+                punching = 0;
+                punch_queued = 0;
+            }
+            block += n;
         }
+    }
+}
 
-        if (current_block != SFS_BLOCKIDX_END) {
-            free_block_chain(current_block);
-            blockidx_t end_marker = SFS_BLOCKIDX_END;
-            disk_write(&end_marker, sizeof(end_marker),
-                       SFS_BLOCKTBL_OFF + current_block * sizeof(blockidx_t));
+// waits on fs_lock itself, so the queue is only touched with the lock held.
+// a pass runs every SFS_PUNCH_DELAY seconds, when the queue fills up and once
+// more at unmount
+static void *punch_main(void *arg) {
+    (void)arg;
+    pthread_mutex_lock(&fs_lock);
+    while (punch_running) {
+        struct timespec until;
+        clock_gettime(CLOCK_REALTIME, &until);
+        until.tv_sec += SFS_PUNCH_DELAY;
+        while (punch_running && punch_queued < SFS_PUNCH_QUEUE &&
+               pthread_cond_timedwait(&punch_wake, &fs_lock, &until) == 0) {
         }
-    } else if (size > (off_t)current_size) {
-        // grow
-        blockidx_t current_block = entry.first_block;
-        blockidx_t prev_block = SFS_BLOCKIDX_EMPTY;
+        punch_pending();
+    }
+    pthread_mutex_unlock(&fs_lock);
+    return NULL;
+}
 
-        if (current_block == SFS_BLOCKIDX_END) {
-            res = allocate_block(&current_block);
-            if (res < 0) return res;
-            entry.first_block = current_block;
+// start the puncher on the image's second descriptor
+static void punch_start(void) {
+    if (image_fd < 0) return;
+    punched = calloc((SFS_BLOCKTBL_NENTRIES + 7) / 8, 1);
+    punch_busy = calloc((SFS_BLOCKTBL_NENTRIES + 7) / 8, 1);
+    punching = punched && punch_busy;
+    punch_running = punching && pthread_create(&punch_thread, NULL, punch_main, NULL) == 0;
+    if (!punch_running) punching = 0;
+}
+
+// seconds between writebacks of the table
+#define SFS_WRITEBACK_DELAY 5
+
+static blockidx_t *writeback_copy; // copies of the pages a writeback writes
+static pthread_mutex_t writeback_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_t writeback_thread;
+static int writeback_running;
+
+static int image_flush(void) {
+    if (image_fd >= 0 && fdatasync(image_fd) < 0) return -errno;
+    return 0;
+}
+
+static unsigned table_page_off(unsigned page, int shadow) {
+    if (shadow) return SFS_DATA_OFF + super.shadow_start * SFS_BLOCK_SIZE + page * SFS_TABLE_PAGE;
+    return SFS_BLOCKTBL_OFF + page * SFS_TABLE_PAGE;
+}
+
+static int page_set(const uint32_t *pages, unsigned page) {
+    return (pages[page / 32] >> (page % 32)) & 1;
+}
+
+// write the copied pages, each to the copy that is not current. neighbouring
+// pages going to the same copy are contiguous there too and go out in one
+// write. only writebacks touch the map, so it can be read without fs_lock
+static void write_pages(const uint32_t *pages) {
+    for (unsigned p = 0; p < SFS_TABLE_PAGES;) {
+        if (!page_set(pages, p)) {
+            p++;
+            continue;
+        }
+        int copy = !sfs_shadow_current(&super, p);
+        unsigned n = 1;
+        size_t len = sfs_table_page_len(p);
+        while (p + n < SFS_TABLE_PAGES && page_set(pages, p + n) &&
+               sfs_shadow_current(&super, p + n) == !copy)
+            len += sfs_table_page_len(p + n++);
+        disk_write(writeback_copy + p * SFS_TABLE_PAGE_ENTRIES, len, table_page_off(p, copy));
+        p += n;
+    }
+}
+
+// commit the dirty pages of a shadowed table. they are copied out under
+// fs_lock, so the callbacks only wait for the copy, never for the disk. one
+// flush makes the pages durable in their other copy, the superblock write
+// that flips their bits switches to all of them at once, and a second flush
+// makes the switch durable before the blocks freed up to the copy go back to
+// the allocator. a plain image has nothing dirty and is only flushed when
+// sync is set
+static int table_writeback(int sync) {
+    pthread_mutex_lock(&writeback_lock);
+    pthread_mutex_lock(&fs_lock);
+    if (!use_shadow()) {
+        pthread_mutex_unlock(&fs_lock);
+        int res = sync ? image_flush() : 0;
+        pthread_mutex_unlock(&writeback_lock);
+        return res;
+    }
+
+    uint32_t pages[SFS_TABLE_MAP_WORDS], any = 0;
+    memcpy(pages, table_dirty, sizeof(pages));
+    memset(table_dirty, 0, sizeof(table_dirty));
+    unsigned ndirty = table_ndirty;
+    table_ndirty = 0;
+    for (unsigned p = 0; p < SFS_TABLE_PAGES; p++) {
+        if (!page_set(pages, p)) continue;
+        memcpy(writeback_copy + p * SFS_TABLE_PAGE_ENTRIES,
+               live_table + p * SFS_TABLE_PAGE_ENTRIES, sfs_table_page_len(p));
+        any = 1;
+    }
+    if (!any && !sync) {
+        pthread_mutex_unlock(&fs_lock);
+        pthread_mutex_unlock(&writeback_lock);
+        return 0;
+    }
+
+    unsigned covered = nheld;
+    struct sfs_super next = super;
+    next.state = SFS_SUPER_DIRTY;
+    next.free_blocks = free_blocks;
+    next.entry_slots = entry_slots;
+    next.used_entries = used_entries;
+    next.shadow_gen++;
+    for (unsigned w = 0; w < SFS_TABLE_MAP_WORDS; w++) next.shadow_map[w] ^= pages[w];
+    next.checksum = sfs_super_checksum(&next);
+    pthread_mutex_unlock(&fs_lock);
+
+    if (any) write_pages(pages);
+    int res = image_flush();
+    int switched = 0;
+    if (res == 0 && any) {
+        disk_write(&next, sizeof(next), SFS_DATA_OFF + SFS_SUPER_BLOCK * SFS_BLOCK_SIZE);
+        switched = 1;
+        res = image_flush();
+    }
+
+    pthread_mutex_lock(&fs_lock);
+    if (switched) {
+        memcpy(super.shadow_map, next.shadow_map, sizeof(super.shadow_map));
+        super.shadow_gen = next.shadow_gen;
+    } else if (res < 0) {
+        // nothing was switched, the pages go out with the next commit
+        for (unsigned w = 0; w < SFS_TABLE_MAP_WORDS; w++) table_dirty[w] |= pages[w];
+        table_ndirty += ndirty;
+    }
+    if (res < 0) covered = 0;
+    for (unsigned i = 0; i < covered; i++) {
+        held_map[held[i] / 8] &= ~(1u << (held[i] % 8));
+        hand_back(held[i]);
+    }
+    nheld -= covered;
+    memmove(held, held + covered, nheld * sizeof(blockidx_t));
+    pthread_mutex_unlock(&fs_lock);
+    pthread_mutex_unlock(&writeback_lock);
+    return res;
+}
+
+// make the home copy of every page current, so the table reads right to code
+// that knows nothing of shadowing. runs at unmount after the last commit,
+// neighbouring pages in one write, and at mount when there is no memory to
+// shadow the table; the caller writes the superblock with the cleared map
+static void table_fold(void) {
+    blockidx_t page[SFS_TABLE_PAGE_ENTRIES];
+    int folded = 0;
+    for (unsigned p = 0; p < SFS_TABLE_PAGES;) {
+        if (!sfs_shadow_current(&super, p)) {
+            p++;
+            continue;
+        }
+        unsigned n = 1;
+        size_t len = sfs_table_page_len(p);
+        const blockidx_t *src = page;
+        if (live_table) {
+            while (p + n < SFS_TABLE_PAGES && sfs_shadow_current(&super, p + n))
+                len += sfs_table_page_len(p + n++);
+            src = live_table + p * SFS_TABLE_PAGE_ENTRIES;
         } else {
-            while (current_block != SFS_BLOCKIDX_END) {
-                prev_block = current_block;
-                disk_read(&current_block, sizeof(current_block),
-                          SFS_BLOCKTBL_OFF + prev_block * sizeof(blockidx_t));
-            }
-            current_block = prev_block;
+            disk_read(page, len, table_page_off(p, 1));
+        }
+        disk_write(src, len, table_page_off(p, 0));
+        folded = 1;
+        p += n;
+    }
+    if (!folded) return;
+    image_flush();
+    memset(super.shadow_map, 0, sizeof(super.shadow_map));
+}
+
+// load the table into memory with one read, a shadowed one with the current
+// copy of every page. without memory for it every access goes to the disk,
+// after a shadowed table is folded home
+static void table_load(void) {
+    int shadow = has_super && (super.features & SFS_FEAT_SHADOW);
+    live_table = malloc(SFS_BLOCKTBL_NENTRIES * sizeof(blockidx_t));
+    if (shadow) {
+        writeback_copy = malloc(SFS_BLOCKTBL_NENTRIES * sizeof(blockidx_t));
+        held = malloc(SFS_BLOCKTBL_NENTRIES * sizeof(blockidx_t));
+        held_map = calloc((SFS_BLOCKTBL_NENTRIES + 7) / 8, 1);
+    }
+    if (!live_table || (shadow && (!writeback_copy || !held || !held_map))) {
+        free(live_table);
+        free(writeback_copy);
+        free(held);
+        free(held_map);
+        live_table = writeback_copy = held = NULL;
+        held_map = NULL;
+        table_fold();
+        return;
+    }
+
+    disk_read(live_table, SFS_BLOCKTBL_NENTRIES * sizeof(blockidx_t), SFS_BLOCKTBL_OFF);
+    for (unsigned p = 0; p < SFS_TABLE_PAGES; p++)
+        if (sfs_shadow_current(&super, p))
+            disk_read(live_table + p * SFS_TABLE_PAGE_ENTRIES, sfs_table_page_len(p),
+                      table_page_off(p, 1));
+}
+
+// waits on fs_lock like the puncher, but drops it for the commit, which
+// takes writeback_lock first. a pass runs every SFS_WRITEBACK_DELAY seconds
+// and as soon as enough pages are dirty
+static void *writeback_main(void *arg) {
+    (void)arg;
+    pthread_mutex_lock(&fs_lock);
+    while (writeback_running) {
+        struct timespec until;
+        clock_gettime(CLOCK_REALTIME, &until);
+        until.tv_sec += SFS_WRITEBACK_DELAY;
+        while (writeback_running && table_ndirty < writeback_pages() &&
+               pthread_cond_timedwait(&writeback_wake, &fs_lock, &until) == 0) {
         }
+        pthread_mutex_unlock(&fs_lock);
+        table_writeback(0);
+        pthread_mutex_lock(&fs_lock);
+    }
+    pthread_mutex_unlock(&fs_lock);
+    return NULL;
+}
 
-        size_t remaining = (size_t)(size - current_size);
-        while (remaining > 0) {
-            blockidx_t new_block;
-            res = allocate_block(&new_block);
-            if (res < 0) return res;
+// recovery of a shadowed table after a crash. the table is the one of the
+// last commit, while entries, directory arrays and the skip and tail
+// references were written as the callbacks ran. one walk over the tree brings
+// them in line: an entry whose first block the table has free got its blocks
+// after the commit and goes without them, its size reading as zeros; a chain
+// is cut where it runs past its file's size or into a block another chain
+// claimed; skip pointers are checked against the chain and tail references
+// rewritten. blocks no entry reaches are freed at the end, and the skip and
+// tail references of every free block cleared, so a chain starting there
+// later inherits nothing. the table changes go out with the first commit
+static int is_reached(const uint8_t *reached, blockidx_t block) {
+    return reached[block / 8] & (1u << (block % 8));
+}
+
+// forget the skip index and tail references at a first block recovery drops
+// because the table has it free. whatever chain starts there next would take
+// them over, with an index block that may belong to another file by now
+static void recover_drop(blockidx_t first) {
+    if (first >= SFS_BLOCKTBL_NENTRIES || live_table[first] != SFS_BLOCKIDX_EMPTY) return;
+    if (use_skipidx()) set_skipidx(first, SFS_BLOCKIDX_EMPTY);
+    drop_tail(first);
+}
+
+// claim a used block for the chain being walked
+static int recover_claim(uint8_t *reached, blockidx_t block) {
+    if (block >= SFS_BLOCKTBL_NENTRIES || live_table[block] == SFS_BLOCKIDX_EMPTY ||
+        is_reached(reached, block))
+        return 0;
+    reached[block / 8] |= 1u << (block % 8);
+    return 1;
+}
 
-            disk_write(&new_block, sizeof(new_block),
-                       SFS_BLOCKTBL_OFF + current_block * sizeof(blockidx_t));
+static void recover_file(uint8_t *reached, struct sfs_entry *entry, unsigned entry_off) {
+    blockidx_t first = entry->first_block;
 
-            char zeros[SFS_BLOCK_SIZE] = {0};
-            disk_write(zeros, SFS_BLOCK_SIZE,
-                       SFS_DATA_OFF + new_block * SFS_BLOCK_SIZE);
+    // a pack block is shared, it only has to be in use
+    if (is_packed_file(entry)) {
+        if (first < SFS_BLOCKTBL_NENTRIES && live_table[first] == SFS_BLOCKIDX_END &&
+            !is_reserved(first)) {
+            reached[first / 8] |= 1u << (first % 8);
+            return;
+        }
+        recover_drop(first);
+        entry->first_block = SFS_BLOCKIDX_END;
+        entry->size = SFS_PACK_LEN(entry->size);
+        put_entry(entry, entry_off);
+        return;
+    }
+    if (first == SFS_BLOCKIDX_END) return;
+    if (!recover_claim(reached, first)) {
+        recover_drop(first);
+        entry->first_block = SFS_BLOCKIDX_END;
+        put_entry(entry, entry_off);
+        return;
+    }
 
-            current_block = new_block;
-            remaining = remaining > SFS_BLOCK_SIZE ? remaining - SFS_BLOCK_SIZE : 0;
+    blockidx_t ptrs[SFS_SKIP_ENTRIES];
+    int ptrs_dirty = 0;
+    blockidx_t idx = skipidx_ref(first);
+    if (idx != SFS_BLOCKIDX_EMPTY &&
+        (idx >= SFS_BLOCKTBL_NENTRIES || is_reserved(idx) ||
+         live_table[idx] != SFS_BLOCKIDX_END || !recover_claim(reached, idx))) {
+        set_skipidx(first, SFS_BLOCKIDX_EMPTY);
+        idx = SFS_BLOCKIDX_EMPTY;
+    }
+    if (idx != SFS_BLOCKIDX_EMPTY)
+        disk_read(ptrs, sizeof(ptrs), SFS_DATA_OFF + idx * SFS_BLOCK_SIZE);
+
+    uint32_t size = entry->size & SFS_SIZEMASK;
+    unsigned need = (size + SFS_BLOCK_SIZE - 1) / SFS_BLOCK_SIZE;
+    blockidx_t block = first;
+    unsigned count = 1;
+    int cut = 0;
+    for (;;) {
+        unsigned pos = count - 1;
+        if (idx != SFS_BLOCKIDX_EMPTY && pos > 0 && pos % SFS_SKIP_STRIDE == 0 &&
+            pos / SFS_SKIP_STRIDE <= SFS_SKIP_ENTRIES && ptrs[pos / SFS_SKIP_STRIDE - 1] != block) {
+            ptrs[pos / SFS_SKIP_STRIDE - 1] = block;
+            ptrs_dirty = 1;
+        }
+        blockidx_t next = live_table[block];
+        if (next == SFS_BLOCKIDX_END) break;
+        if (count >= need || !recover_claim(reached, next)) {
+            cut = 1;
+            break;
         }
+        block = next;
+        count++;
+    }
 
+    if (cut) {
         blockidx_t end_marker = SFS_BLOCKIDX_END;
-        disk_write(&end_marker, sizeof(end_marker),
-                   SFS_BLOCKTBL_OFF + current_block * sizeof(blockidx_t));
+        table_write(&end_marker, 1, block);
+        if (count == need && size % SFS_BLOCK_SIZE)
+            zero_block_range(block, size % SFS_BLOCK_SIZE, SFS_BLOCK_SIZE);
+    }
+    for (unsigned i = 0; idx != SFS_BLOCKIDX_EMPTY && i < SFS_SKIP_ENTRIES; i++) {
+        if ((i + 1) * SFS_SKIP_STRIDE < count || ptrs[i] == SFS_BLOCKIDX_EMPTY) continue;
+        ptrs[i] = SFS_BLOCKIDX_EMPTY;
+        ptrs_dirty = 1;
     }
+    if (ptrs_dirty) disk_write(ptrs, sizeof(ptrs), SFS_DATA_OFF + idx * SFS_BLOCK_SIZE);
+    set_tail(first, block, count);
+}
 
-    entry.size = (uint32_t)size;
-    disk_write(&entry, sizeof(entry), entry_off);
+static void recover_dir(uint8_t *reached, unsigned dir_off, unsigned num_entries) {
+    struct dir_scan *scan = malloc(sizeof(*scan));
+    if (!scan) return;
+
+    struct sfs_entry entry;
+    unsigned entry_off;
+    dir_scan_start(scan, dir_off, num_entries);
+    while (dir_scan_next(scan, &entry, &entry_off)) {
+        if (strlen(entry.filename) == 0) continue;
+        if (!(entry.size & SFS_DIRECTORY)) {
+            recover_file(reached, &entry, entry_off);
+            continue;
+        }
+        if (entry.first_block == SFS_BLOCKIDX_END) continue;
+
+        // the array is one contiguous run, all of it or nothing is kept
+        blockidx_t first = entry.first_block;
+        unsigned n = 0;
+        while (n < SFS_DIR_BLOCKS && first + n < SFS_BLOCKTBL_NENTRIES &&
+               !is_reached(reached, first + n) &&
+               live_table[first + n] == (n + 1 < SFS_DIR_BLOCKS ? first + n + 1 : SFS_BLOCKIDX_END))
+            n++;
+        if (n < SFS_DIR_BLOCKS) {
+            entry.first_block = SFS_BLOCKIDX_END;
+            put_entry(&entry, entry_off);
+            continue;
+        }
+        for (n = 0; n < SFS_DIR_BLOCKS; n++) recover_claim(reached, first + n);
+        recover_dir(reached, SFS_DATA_OFF + first * SFS_BLOCK_SIZE, SFS_DIR_NENTRIES);
+    }
+    free(scan);
+}
+
+// clear the skip index and tail references at every free block once the
+// sweep is done, as sfs-fsck does, each region read and written in one go
+static void recover_refs(void) {
+    if (use_skipidx()) {
+        blockidx_t *refs = malloc(SFS_BLOCKTBL_NENTRIES * sizeof(blockidx_t));
+        if (refs) {
+            int dirty = 0;
+            disk_read(refs, SFS_BLOCKTBL_NENTRIES * sizeof(blockidx_t), skipref_off(0));
+            for (unsigned b = 0; b < SFS_BLOCKTBL_NENTRIES; b++) {
+                if (live_table[b] != SFS_BLOCKIDX_EMPTY || refs[b] == SFS_BLOCKIDX_EMPTY) continue;
+                refs[b] = SFS_BLOCKIDX_EMPTY;
+                dirty = 1;
+            }
+            if (dirty) disk_write(refs, SFS_BLOCKTBL_NENTRIES * sizeof(blockidx_t), skipref_off(0));
+            free(refs);
+        }
+    }
+    if (use_tailref()) {
+        struct sfs_tailref *refs = malloc(SFS_BLOCKTBL_NENTRIES * sizeof(struct sfs_tailref));
+        if (refs) {
+            int dirty = 0;
+            disk_read(refs, SFS_BLOCKTBL_NENTRIES * sizeof(struct sfs_tailref), tailref_off(0));
+            for (unsigned b = 0; b < SFS_BLOCKTBL_NENTRIES; b++) {
+                if (live_table[b] != SFS_BLOCKIDX_EMPTY || refs[b].count == 0) continue;
+                refs[b].count = 0;
+                dirty = 1;
+            }
+            if (dirty)
+                disk_write(refs, SFS_BLOCKTBL_NENTRIES * sizeof(struct sfs_tailref),
+                           tailref_off(0));
+            free(refs);
+        }
+    }
+}
+
+static void table_recover(void) {
+    uint8_t *reached = calloc((SFS_BLOCKTBL_NENTRIES + 7) / 8, 1);
+    if (!reached) return;
+    for (unsigned b = 0; b < SFS_BLOCKTBL_NENTRIES; b++)
+        if (is_reserved(b)) reached[b / 8] |= 1u << (b % 8);
+
+    recover_dir(reached, SFS_ROOTDIR_OFF, SFS_ROOTDIR_NENTRIES);
+
+    blockidx_t empty = SFS_BLOCKIDX_EMPTY;
+    for (unsigned b = 0; b < SFS_BLOCKTBL_NENTRIES; b++)
+        if (live_table[b] != SFS_BLOCKIDX_EMPTY && !is_reached(reached, b))
+            table_write(&empty, 1, b);
+    free(reached);
+    recover_refs();
+}
+
+// count used slots in a directory and everything below it
+static void count_entries(unsigned dir_off, unsigned num_entries) {
+    struct dir_scan *scan = malloc(sizeof(*scan));
+    if (!scan) return;
+
+    entry_slots += dir_off == SFS_ROOTDIR_OFF ? num_entries : dir_slots();
+    struct sfs_entry entry;
+    unsigned entry_off;
+    dir_scan_start(scan, dir_off, num_entries);
+    while (dir_scan_next(scan, &entry, &entry_off)) {
+        if (strlen(entry.filename) == 0) continue;
+        used_entries++;
+        if ((entry.size & SFS_DIRECTORY) && entry.first_block != SFS_BLOCKIDX_END)
+            count_entries(SFS_DATA_OFF + entry.first_block * SFS_BLOCK_SIZE, SFS_DIR_NENTRIES);
+    }
+    free(scan);
+}
+
+// one pass over the table and the tree to seed the statfs counters
+static void init_counters(void) {
+    blockidx_t chunk[SFS_SCAN_CHUNK];
+
+    free_blocks = 0;
+    for (unsigned i = 0; i < SFS_BLOCKTBL_NENTRIES; i += SFS_SCAN_CHUNK) {
+        unsigned count = SFS_BLOCKTBL_NENTRIES - i;
+        if (count > SFS_SCAN_CHUNK) count = SFS_SCAN_CHUNK;
+        table_read(chunk, count, i);
+        for (unsigned j = 0; j < count; j++)
+            if (chunk[j] == SFS_BLOCKIDX_EMPTY && i + j != SFS_BLOCKIDX_EMPTY) free_blocks++;
+    }
+
+    entry_slots = 0;
+    used_entries = 0;
+    count_entries(SFS_ROOTDIR_OFF, SFS_ROOTDIR_NENTRIES);
+}
+
+// look for a superblock: its block is marked used in the table and it must
+// carry a valid checksum, anything else is a plain image
+static void load_super(void) {
+    blockidx_t mark;
+    table_read(&mark, 1, SFS_SUPER_BLOCK);
+    has_super = 0;
+    if (mark != SFS_BLOCKIDX_END) return;
+    disk_read(&super, sizeof(super), SFS_DATA_OFF + SFS_SUPER_BLOCK * SFS_BLOCK_SIZE);
+    has_super = sfs_super_valid(&super);
+}
+
+// store the counters and the free list head in the superblock
+static void write_super(uint32_t state) {
+    super.state = state;
+    super.free_blocks = free_blocks;
+    super.entry_slots = entry_slots;
+    super.used_entries = used_entries;
+    super.checksum = sfs_super_checksum(&super);
+    disk_write(&super, sizeof(super), SFS_DATA_OFF + SFS_SUPER_BLOCK * SFS_BLOCK_SIZE);
+}
+
+// relink every free block in ascending order. the links a crash left behind
+// cannot be trusted, so this runs instead of the clean mount path. links are
+// written a chunk at a time, only the forward link out of a finished chunk is
+// patched separately
+static void rebuild_freelist(void) {
+    blockidx_t chunk[SFS_SCAN_CHUNK];
+    struct sfs_freelink links[SFS_SCAN_CHUNK];
+    blockidx_t prev = SFS_BLOCKIDX_END;
+
+    super.free_head = SFS_BLOCKIDX_END;
+    for (unsigned i = 0; i < SFS_BLOCKTBL_NENTRIES; i += SFS_SCAN_CHUNK) {
+        unsigned count = SFS_BLOCKTBL_NENTRIES - i;
+        if (count > SFS_SCAN_CHUNK) count = SFS_SCAN_CHUNK;
+        table_read(chunk, count, i);
+
+        for (unsigned j = 0; j < count; j++) {
+            links[j].prev = SFS_BLOCKIDX_END;
+            links[j].next = SFS_BLOCKIDX_END;
+            if (chunk[j] != SFS_BLOCKIDX_EMPTY || i + j == SFS_BLOCKIDX_EMPTY) continue;
+
+            blockidx_t block = i + j;
+            links[j].prev = prev;
+            if (prev == SFS_BLOCKIDX_END)
+                super.free_head = block;
+            else if (prev >= i)
+                links[prev - i].next = block;
+            else
+                disk_write(&block, sizeof(block),
+                           freelink_off(prev) + offsetof(struct sfs_freelink, next));
+            prev = block;
+        }
+        disk_write(links, count * sizeof(struct sfs_freelink), freelink_off(i));
+    }
+}
+
+// let the kernel cache writes and send them back later, FUSE's writeback
+// cache mode (set by main). the kernel then keeps the size of a file with
+// cached writes itself, and sends mtime along with truncates and on close
+static int cache_writes;
+
+// init asks the kernel for large requests and, when enabled, cached writes,
+// loads the table, seeds the statfs counters, builds the buddy index if
+// enabled and starts the committer of a shadowed table, the hole puncher
+// and the background defragmenter when configured. an image with a superblock that
+// was unmounted cleanly takes its counters and free list from there without
+// touching the table; after a crash a shadowed table is recovered first
+static void *sfs_init(struct fuse_conn_info *conn) {
+#ifdef FUSE_CAP_BIG_WRITES
+    conn->want |= FUSE_CAP_BIG_WRITES;
+#endif
+#ifdef FUSE_CAP_WRITEBACK_CACHE
+    if (cache_writes && (conn->capable & FUSE_CAP_WRITEBACK_CACHE))
+        conn->want |= FUSE_CAP_WRITEBACK_CACHE;
+#endif
+    conn->max_write = SFS_MAX_REQUEST;
+
+    if (image_path) image_fd = open(image_path, O_RDWR);
+    load_super();
+    table_load();
+    if (has_super && super.state == SFS_SUPER_CLEAN) {
+        free_blocks = super.free_blocks;
+        entry_slots = super.entry_slots;
+        used_entries = super.used_entries;
+    } else {
+        if (use_shadow()) table_recover();
+        init_counters();
+        if (use_freelist()) rebuild_freelist();
+    }
+    if (buddy_enabled) buddy_build();
+    // marked dirty until unmount, so a crash is noticed at the next mount
+    if (has_super) write_super(SFS_SUPER_DIRTY);
+
+    if (use_shadow()) {
+        writeback_running = 1;
+        if (pthread_create(&writeback_thread, NULL, writeback_main, NULL) != 0)
+            writeback_running = 0;
+    }
+    if (punch_holes) punch_start();
+    if (defrag_rate > 0) {
+        defrag_running = 1;
+        if (pthread_create(&defrag_thread, NULL, defrag_main, NULL) != 0) defrag_running = 0;
+    }
+    return NULL;
+}
+
+// destroy stops the background threads before the image is closed, commits a
+// shadowed table and folds it home, and saves the counters and free list head
+// for the next mount
+static void sfs_destroy(void *private_data) {
+    (void)private_data;
+
+    if (defrag_running) {
+        pthread_mutex_lock(&defrag_wait_lock);
+        defrag_running = 0;
+        pthread_cond_broadcast(&defrag_wake);
+        pthread_mutex_unlock(&defrag_wait_lock);
+        pthread_join(defrag_thread, NULL);
+    }
+    // after the defragmenter, whose last moves free blocks too
+    if (punch_running) {
+        pthread_mutex_lock(&fs_lock);
+        punch_running = 0;
+        pthread_cond_signal(&punch_wake);
+        pthread_mutex_unlock(&fs_lock);
+        pthread_join(punch_thread, NULL);
+        punching = 0;
+    }
+    if (writeback_running) {
+        pthread_mutex_lock(&fs_lock);
+        writeback_running = 0;
+        pthread_cond_signal(&writeback_wake);
+        pthread_mutex_unlock(&fs_lock);
+        pthread_join(writeback_thread, NULL);
+    }
+    table_writeback(1);
+    if (use_shadow()) table_fold();
+
+    if (has_super) write_super(SFS_SUPER_CLEAN);
+    if (image_fd >= 0) {
+        image_flush();
+        close(image_fd);
+        image_fd = -1;
+    }
+}
+
+// recursive delete of a directory tree in one locked call. every directory
+// array is read once, chains are followed and freed in a copy of the table
+// read with one disk read, and the table, free list links and buddy index
+// are updated a run of freed blocks at a time at the end. the tree's entry
+// is cleared first, so a crash part way leaves only leaked blocks behind
+struct rmtree {
+    blockidx_t *table;
+    uint8_t *freed;
+    unsigned files, dirs, blocks;
+};
+
+static void rmtree_chain(struct rmtree *rm, blockidx_t block) {
+    while (block < SFS_BLOCKTBL_NENTRIES && block != SFS_BLOCKIDX_EMPTY && !rm->freed[block]) {
+        blockidx_t next = rm->table[block];
+        rm->table[block] = SFS_BLOCKIDX_EMPTY;
+        rm->freed[block] = 1;
+        rm->blocks++;
+        block = next;
+    }
+}
+
+// free what an entry owns; a directory's subdirectories go on the stack
+static int rmtree_entry(struct rmtree *rm, const struct sfs_entry *entry,
+                        blockidx_t **stack, unsigned *depth, unsigned *cap) {
+    if (entry->size & SFS_DIRECTORY) {
+        rm->dirs++;
+        if (entry->first_block == SFS_BLOCKIDX_END) return 0;
+        if (*depth == *cap) {
+            unsigned grown_cap = *cap ? *cap * 2 : 64;
+            blockidx_t *grown = realloc(*stack, grown_cap * sizeof(blockidx_t));
+            if (!grown) return -ENOMEM;
+            *stack = grown;
+            *cap = grown_cap;
+        }
+        (*stack)[(*depth)++] = entry->first_block;
+        return 0;
+    }
+
+    rm->files++;
+    if (is_packed_file(entry)) {
+        pack_free(entry);
+        return 0;
+    }
+    blockidx_t idx = skipidx_ref(entry->first_block);
+    if (idx != SFS_BLOCKIDX_EMPTY) {
+        if (skipidx_valid(idx)) rmtree_chain(rm, idx);
+        set_skipidx(entry->first_block, SFS_BLOCKIDX_EMPTY);
+    }
+    drop_tail(entry->first_block);
+    rmtree_chain(rm, entry->first_block);
     return 0;
 }
 
-// write copies from buf to file, grows the chain if needed, returns bytes written
-static int sfs_write(const char *path, const char *buf, size_t size,
-                     off_t offset, struct fuse_file_info *fi) {
-    (void)fi;
+// hand the freed blocks back a run at a time: one table write and one free
+// list write per run, the freed blocks linked in ascending order in front of
+// the old list. a shadowed table holds them for the next commit instead
+static void rmtree_release(struct rmtree *rm) {
+    blockidx_t old_head = has_super ? (blockidx_t)super.free_head : SFS_BLOCKIDX_END;
+    blockidx_t last = SFS_BLOCKIDX_END;
+    struct sfs_freelink links[SFS_SCAN_CHUNK];
+
+    for (unsigned b = 0; b < SFS_BLOCKTBL_NENTRIES;) {
+        if (!rm->freed[b]) {
+            b++;
+            continue;
+        }
+        unsigned first = b;
+        while (b < SFS_BLOCKTBL_NENTRIES && rm->freed[b] && b - first < SFS_SCAN_CHUNK) b++;
+        unsigned len = b - first;
+
+        table_write(rm->table + first, len, first);
+        if (use_shadow()) {
+            for (unsigned i = 0; i < len; i++) release_block(first + i);
+            continue;
+        }
+        for (unsigned i = 0; i < len; i++) punch_note(first + i);
+        if (buddy_enabled) buddy_free_range(first, len);
+        free_blocks += len;
+        if (!use_freelist()) continue;
+
+        // the run's last link is patched once the next run is known
+        blockidx_t head = first;
+        if (last == SFS_BLOCKIDX_END)
+            super.free_head = head;
+        else
+            disk_write(&head, sizeof(head),
+                       freelink_off(last) + offsetof(struct sfs_freelink, next));
+        for (unsigned i = 0; i < len; i++) {
+            links[i].prev = i > 0 ? first + i - 1 : last;
+            links[i].next = i + 1 < len ? first + i + 1 : old_head;
+        }
+        disk_write(links, len * sizeof(struct sfs_freelink), freelink_off(first));
+        last = b - 1;
+    }
+
+    if (use_freelist() && last != SFS_BLOCKIDX_END && old_head != SFS_BLOCKIDX_END)
+        disk_write(&last, sizeof(last),
+                   freelink_off(old_head) + offsetof(struct sfs_freelink, prev));
+}
+
+// caller holds fs_lock
+static int rmtree_locked(const char *path, struct sfs_rmtree_req *req) {
+    if (strcmp(path, "/") == 0) return -EBUSY;
+
+    // unlocked writes may be copying into blocks of the tree
+    while (ranges_held > 0) pthread_cond_wait(&range_done, &fs_lock);
 
     struct sfs_entry entry;
     unsigned entry_off;
     int res = get_entry(path, &entry, &entry_off);
     if (res < 0) return res;
-    if (entry.size & SFS_DIRECTORY) return -EISDIR;
-
-    uint32_t new_size = (offset + size > (entry.size & SFS_SIZEMASK))
-        ? (uint32_t)(offset + size)
-        : (entry.size & SFS_SIZEMASK);
+    if (!(entry.size & SFS_DIRECTORY)) return -ENOTDIR;
 
-    // ensure there is at least a first block
-    if (entry.first_block == SFS_BLOCKIDX_END) {
-        blockidx_t new_block = find_free_block();
-        if (new_block == SFS_BLOCKIDX_EMPTY) return -ENOSPC;
-        entry.first_block = new_block;
-        blockidx_t end_marker = SFS_BLOCKIDX_END;
-        disk_write(&end_marker, sizeof(end_marker),
-                   SFS_BLOCKTBL_OFF + new_block * sizeof(blockidx_t));
+    struct rmtree rm = {0};
+    rm.table = malloc(SFS_BLOCKTBL_NENTRIES * sizeof(blockidx_t));
+    rm.freed = calloc(SFS_BLOCKTBL_NENTRIES, 1);
+    struct dir_scan *scan = malloc(sizeof(*scan));
+    blockidx_t *stack = NULL;
+    unsigned depth = 0, cap = 0;
+    if (!rm.table || !rm.freed || !scan) {
+        free(rm.table);
+        free(rm.freed);
+        free(scan);
+        return -ENOMEM;
+    }
+    table_read(rm.table, SFS_BLOCKTBL_NENTRIES, 0);
+
+    clear_entry(entry_off);
+    used_entries--;
+    res = rmtree_entry(&rm, &entry, &stack, &depth, &cap);
+
+    while (res == 0 && depth > 0) {
+        blockidx_t first_block = stack[--depth];
+        dir_scan_start(scan, SFS_DATA_OFF + first_block * SFS_BLOCK_SIZE, SFS_DIR_NENTRIES);
+        struct sfs_entry child;
+        unsigned child_off;
+        while (res == 0 && dir_scan_next(scan, &child, &child_off)) {
+            if (strlen(child.filename) == 0) continue;
+            lookup_drop(child_off);
+            gen_bump(child_off);
+            used_entries--;
+            res = rmtree_entry(&rm, &child, &stack, &depth, &cap);
+        }
+        rmtree_chain(&rm, first_block);
+        entry_slots -= dir_slots();
     }
 
-    blockidx_t current_block = entry.first_block;
-    off_t current_offset = 0;
+    // the blocks of directories left on the stack by a failure are leaked
+    rmtree_release(&rm);
+    if (req) {
+        req->files = rm.files;
+        req->dirs = rm.dirs;
+        req->blocks = rm.blocks;
+    }
+    free(stack);
+    free(scan);
+    free(rm.freed);
+    free(rm.table);
+    return res;
+}
 
-    // walk to the block that contains the starting offset
-    while (current_offset + SFS_BLOCK_SIZE <= offset &&
-           current_block != SFS_BLOCKIDX_END) {
-        disk_read(&current_block, sizeof(current_block),
-                  SFS_BLOCKTBL_OFF + current_block * sizeof(blockidx_t));
-        current_offset += SFS_BLOCK_SIZE;
+// ioctl lets sfs-defrag drive the defragmenter one step per call, and
+// sfs-rmtree delete a directory tree
+static int sfs_ioctl(const char *path, int cmd, void *arg, struct fuse_file_info *fi,
+                     unsigned int flags, void *data) {
+    (void)arg;
+    (void)fi;
+    if (flags & FUSE_IOCTL_COMPAT) return -ENOSYS;
+
+    switch ((unsigned)cmd) {
+    case SFS_IOC_DEFRAG: {
+        struct sfs_defrag_req *req = data;
+        unsigned next;
+        pthread_mutex_lock(&fs_lock);
+        wait_file(path);
+        int res = defrag_step(path, req->start, req->max_blocks, &next);
+        pthread_mutex_unlock(&fs_lock);
+        if (res < 0) return res;
+        req->moved = (uint32_t)res;
+        req->next = next;
+        return 0;
+    }
+    case SFS_IOC_RMTREE: {
+        pthread_mutex_lock(&fs_lock);
+        int res = rmtree_locked(path, data);
+        pthread_mutex_unlock(&fs_lock);
+        return res;
     }
+    default:
+        return -ENOTTY;
+    }
+}
 
-    // if we need to step through empty space to reach offset
-    while (current_offset + SFS_BLOCK_SIZE <= offset) {
-        blockidx_t new_block = find_free_block();
-        if (new_block == SFS_BLOCKIDX_EMPTY) return -ENOSPC;
+// statfs answers from the counters, so polling it costs no disk access
+static int sfs_statfs(const char *path, struct statvfs *st) {
+    (void)path;
+
+    memset(st, 0, sizeof(struct statvfs));
+    st->f_bsize = SFS_BLOCK_SIZE;
+    st->f_frsize = SFS_BLOCK_SIZE;
+    st->f_namemax = SFS_FILENAME_MAX - 1;
+
+    pthread_mutex_lock(&fs_lock);
+    st->f_blocks = SFS_BLOCKTBL_NENTRIES;
+    st->f_bfree = free_blocks;
+    st->f_bavail = free_blocks;
+    st->f_files = entry_slots;
+    st->f_ffree = entry_slots - used_entries;
+    st->f_favail = entry_slots - used_entries;
+    pthread_mutex_unlock(&fs_lock);
+    return 0;
+}
 
-        disk_write(&new_block, sizeof(new_block),
-                   SFS_BLOCKTBL_OFF + current_block * sizeof(blockidx_t));
+// the callbacks take fs_lock around the implementations above, so the
+// defragmenter never sees a chain or an entry halfway through an update.
+// those that read, free or move a file's blocks first wait out the unlocked
+// writes they would overlap
 
-        current_block = new_block;
-        current_offset += SFS_BLOCK_SIZE;
+// getattr answers from the lookup cache without the lock when it can
+static int sfs_getattr(const char *path, struct stat *st) {
+    struct sfs_entry entry;
+    if (lookup_cached(path, &entry)) {
+        fill_stat(&entry, st);
+        return 0;
     }
 
-    // write data across blocks
-    size_t written = 0;
-    while (written < size) {
-        size_t block_off = offset + written - current_offset;
-        size_t can_write = SFS_BLOCK_SIZE - block_off;
-        if (can_write > size - written) can_write = size - written;
+    pthread_mutex_lock(&fs_lock);
+    int res = sfs_getattr_locked(path, st);
+    pthread_mutex_unlock(&fs_lock);
+    return res;
+}
 
-        disk_write(buf + written, can_write,
-                   SFS_DATA_OFF + current_block * SFS_BLOCK_SIZE + block_off);
+static int sfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
+                       off_t offset, struct fuse_file_info *fi) {
+    pthread_mutex_lock(&fs_lock);
+    int res = sfs_readdir_locked(path, buf, filler, offset, fi);
+    pthread_mutex_unlock(&fs_lock);
+    return res;
+}
 
-        written += can_write;
+static int sfs_read(const char *path, char *buf, size_t size, off_t offset,
+                    struct fuse_file_info *fi) {
+    pthread_mutex_lock(&fs_lock);
+    wait_ranges(path, offset, offset + size);
+    int res = sfs_read_locked(path, buf, size, offset, fi);
+    pthread_mutex_unlock(&fs_lock);
+    return res;
+}
 
-        if (written < size) {
-            blockidx_t next_block;
-            disk_read(&next_block, sizeof(next_block),
-                      SFS_BLOCKTBL_OFF + current_block * sizeof(blockidx_t));
+static int sfs_mkdir(const char *path, mode_t mode) {
+    pthread_mutex_lock(&fs_lock);
+    int res = sfs_mkdir_locked(path, mode);
+    pthread_mutex_unlock(&fs_lock);
+    return res;
+}
 
-            if (next_block == SFS_BLOCKIDX_END) {
-                next_block = find_free_block();
-                if (next_block == SFS_BLOCKIDX_EMPTY) break;
+static int sfs_rmdir(const char *path) {
+    pthread_mutex_lock(&fs_lock);
+    int res = sfs_rmdir_locked(path);
+    pthread_mutex_unlock(&fs_lock);
+    return res;
+}
 
-                disk_write(&next_block, sizeof(next_block),
-                           SFS_BLOCKTBL_OFF + current_block * sizeof(blockidx_t));
+static int sfs_unlink(const char *path) {
+    pthread_mutex_lock(&fs_lock);
+    wait_file(path);
+    int res = sfs_unlink_locked(path);
+    pthread_mutex_unlock(&fs_lock);
+    return res;
+}
 
-                blockidx_t end_marker = SFS_BLOCKIDX_END;
-                disk_write(&end_marker, sizeof(end_marker),
-                           SFS_BLOCKTBL_OFF + next_block * sizeof(blockidx_t));
-            }
+static int sfs_open(const char *path, struct fuse_file_info *fi) {
+    pthread_mutex_lock(&fs_lock);
+    int res = sfs_open_locked(path, fi);
+    pthread_mutex_unlock(&fs_lock);
+    return res;
+}
 
-            current_block = next_block;
-            current_offset += SFS_BLOCK_SIZE;
-        }
-    }
+static int sfs_create(const char *path, mode_t mode, struct fuse_file_info *fi) {
+    pthread_mutex_lock(&fs_lock);
+    int res = sfs_create_locked(path, mode, fi);
+    pthread_mutex_unlock(&fs_lock);
+    return res;
+}
 
-    // update file size if we extended
-    if (new_size > (entry.size & SFS_SIZEMASK)) {
-        entry.size = new_size;
-        disk_write(&entry, sizeof(entry), entry_off);
+static int sfs_truncate(const char *path, off_t size) {
+    pthread_mutex_lock(&fs_lock);
+    wait_file(path);
+    int res = sfs_truncate_locked(path, size);
+    pthread_mutex_unlock(&fs_lock);
+    return res;
+}
+
+// sfs keeps no times, but with cached writes the kernel sends mtime with every
+// truncate and when a file is closed, and both would fail without this
+static int sfs_utimens(const char *path, const struct timespec tv[2]) {
+    (void)tv;
+    struct sfs_entry entry;
+    if (lookup_cached(path, &entry)) return 0;
+
+    unsigned entry_off;
+    pthread_mutex_lock(&fs_lock);
+    int res = get_entry(path, &entry, &entry_off);
+    pthread_mutex_unlock(&fs_lock);
+    return res < 0 ? res : 0;
+}
+
+// overwrites inside the file go through write_in_place, the rest extends the
+// chain or the size under the lock. a write past the size, which cached
+// writes send when the kernel writes pages back out of order, reads as zeros
+// up to its offset until the pages before it arrive
+static int sfs_write(const char *path, const char *buf, size_t size,
+                     off_t offset, struct fuse_file_info *fi) {
+    pthread_mutex_lock(&fs_lock);
+    int res = write_in_place(path, buf, size, offset);
+    if (res == -EAGAIN) {
+        wait_ranges(path, offset, offset + size);
+        res = sfs_write_locked(path, buf, size, offset, fi);
     }
+    pthread_mutex_unlock(&fs_lock);
+    return res;
+}
 
-    return (int)written;
+// fsync commits a shadowed table and flushes the image, data written before
+// it included
+static int sfs_fsync(const char *path, int datasync, struct fuse_file_info *fi) {
+    (void)path;
+    (void)datasync;
+    (void)fi;
+    return table_writeback(1);
+}
+
+static int sfs_fallocate(const char *path, int mode, off_t offset, off_t len,
+                         struct fuse_file_info *fi) {
+    pthread_mutex_lock(&fs_lock);
+    wait_file(path);
+    int res = sfs_fallocate_locked(path, mode, offset, len, fi);
+    pthread_mutex_unlock(&fs_lock);
+    return res;
 }
\ No newline at end of file
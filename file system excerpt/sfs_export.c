@@ -0,0 +1,278 @@
+/* sfs-export: copy every file out of an unmounted sfs image.
+   The root area and block table are loaded once and the tree is walked
+   level by level in block order, so every directory array is read once.
+   Files are then streamed out sorted by the position of their first block,
+   consecutive blocks of a chain read together, which keeps the reads on the
+   image front to back. Parts of a file past the end of its chain are holes
+   and come out as zeros.
+
+   The output is a ustar archive on stdout, or with -C the tree is recreated
+   under a host directory, holes left sparse.
+
+   usage: sfs-export [-C directory] image
+*/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "sfs_image.h"
+
+// blocks read from the image at once
+#define EXPORT_RUN 256
+
+#define TAR_BLOCK 512
+
+struct export_file {
+    char *path;
+    blockidx_t first_block;
+    uint32_t size;
+    unsigned pack_off;          // byte offset in the pack block, packed files only
+    int packed;
+};
+
+struct exporter {
+    struct sfs_image *img;
+    const char *dest;           // host directory, NULL for a tar stream
+    struct export_file *files;
+    size_t nfiles, files_cap;
+    unsigned long dirs;
+    unsigned long long bytes;
+    int out;                    // current output, the tar stream or one host file
+};
+
+static int write_all(int fd, const char *buf, size_t size) {
+    while (size > 0) {
+        ssize_t n = write(fd, buf, size);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) return -errno;
+        buf += n;
+        size -= (size_t)n;
+    }
+    return 0;
+}
+
+// hand n bytes of file data to the output, buf NULL meaning zeros. a host
+// file skips over them and gets its length from ftruncate at the end
+static int put_data(struct exporter *ex, const char *buf, size_t n) {
+    static const char zeros[TAR_BLOCK];
+    if (buf) return write_all(ex->out, buf, n);
+    if (ex->dest) return lseek(ex->out, (off_t)n, SEEK_CUR) < 0 ? -errno : 0;
+    while (n > 0) {
+        size_t m = n < sizeof(zeros) ? n : sizeof(zeros);
+        int res = write_all(ex->out, zeros, m);
+        if (res < 0) return res;
+        n -= m;
+    }
+    return 0;
+}
+
+// stream a file's data, reading consecutive chain blocks with one read
+static int put_file_data(struct exporter *ex, const struct export_file *file) {
+    static char buf[EXPORT_RUN * SFS_BLOCK_SIZE];
+    struct sfs_image *img = ex->img;
+
+    if (file->packed) {
+        int res = sfs_image_read(img, buf, file->size,
+                                 SFS_DATA_OFF + (off_t)file->first_block * SFS_BLOCK_SIZE +
+                                     file->pack_off);
+        return res < 0 ? res : put_data(ex, buf, file->size);
+    }
+
+    uint32_t left = file->size;
+    blockidx_t block = file->first_block;
+    unsigned long hops = 0;
+    while (left > 0 && block != SFS_BLOCKIDX_END) {
+        if (block >= SFS_BLOCKTBL_NENTRIES || block == SFS_BLOCKIDX_EMPTY ||
+            hops >= SFS_BLOCKTBL_NENTRIES)
+            return -EIO;
+
+        // extend the run while the chain stays contiguous
+        blockidx_t first = block;
+        unsigned run = 1;
+        while (run < EXPORT_RUN && (uint64_t)run * SFS_BLOCK_SIZE < left &&
+               img->table[first + run - 1] == first + run)
+            run++;
+        block = img->table[first + run - 1];
+        hops += run;
+
+        size_t n = (size_t)run * SFS_BLOCK_SIZE;
+        if (n > left) n = left;
+        int res = sfs_image_read(img, buf, n, SFS_DATA_OFF + (off_t)first * SFS_BLOCK_SIZE);
+        if (res == 0) res = put_data(ex, buf, n);
+        if (res < 0) return res;
+        left -= (uint32_t)n;
+    }
+    // past the end of the chain the file is a hole
+    return left > 0 ? put_data(ex, NULL, left) : 0;
+}
+
+// ustar header; the path is split into prefix and name where it is too long
+// for the name field alone
+static int tar_header(struct exporter *ex, const char *path, int is_dir, uint32_t size) {
+    char hdr[TAR_BLOCK];
+    memset(hdr, 0, sizeof(hdr));
+
+    size_t len = strlen(path);
+    const char *name = path;
+    if (len > 100) {
+        const char *split = path + len - 101;
+        while (*split && *split != '/') split++;
+        if (!*split || split - path > 155) return -ENAMETOOLONG;
+        memcpy(hdr + 345, path, (size_t)(split - path));
+        name = split + 1;
+    }
+    memcpy(hdr, name, strlen(name));
+
+    snprintf(hdr + 100, 8, "%07o", is_dir ? 0755 : 0644);
+    snprintf(hdr + 108, 8, "%07o", 0);
+    snprintf(hdr + 116, 8, "%07o", 0);
+    snprintf(hdr + 124, 12, "%011o", size);
+    snprintf(hdr + 136, 12, "%011o", 0);
+    hdr[156] = is_dir ? '5' : '0';
+    memcpy(hdr + 257, "ustar", 6);
+    memcpy(hdr + 263, "00", 2);
+
+    memset(hdr + 148, ' ', 8);
+    unsigned sum = 0;
+    for (unsigned i = 0; i < sizeof(hdr); i++) sum += (unsigned char)hdr[i];
+    snprintf(hdr + 148, 8, "%06o", sum);
+    return write_all(ex->out, hdr, sizeof(hdr));
+}
+
+static int export_dir(struct exporter *ex, const char *path) {
+    if (!ex->dest) {
+        char *name = malloc(strlen(path) + 2);
+        if (!name) return -ENOMEM;
+        sprintf(name, "%s/", path + 1);
+        int res = tar_header(ex, name, 1, 0);
+        if (res == -ENAMETOOLONG) fprintf(stderr, "sfs-export: %s: path too long\n", path);
+        free(name);
+        return res;
+    }
+
+    char *host = malloc(strlen(ex->dest) + strlen(path) + 1);
+    if (!host) return -ENOMEM;
+    sprintf(host, "%s%s", ex->dest, path);
+    int res = mkdir(host, 0755) < 0 && errno != EEXIST ? -errno : 0;
+    if (res < 0) fprintf(stderr, "sfs-export: %s: %s\n", host, strerror(-res));
+    free(host);
+    return res;
+}
+
+static int export_file(struct exporter *ex, const struct export_file *file) {
+    if (!ex->dest) {
+        int res = tar_header(ex, file->path + 1, 0, file->size);
+        if (res == -ENAMETOOLONG) fprintf(stderr, "sfs-export: %s: path too long\n", file->path);
+        if (res == 0) res = put_file_data(ex, file);
+        if (res == 0 && file->size % TAR_BLOCK)
+            res = put_data(ex, NULL, TAR_BLOCK - file->size % TAR_BLOCK);
+        return res;
+    }
+
+    char *host = malloc(strlen(ex->dest) + strlen(file->path) + 1);
+    if (!host) return -ENOMEM;
+    sprintf(host, "%s%s", ex->dest, file->path);
+    ex->out = open(host, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    int res = ex->out < 0 ? -errno : put_file_data(ex, file);
+    if (res == 0 && ftruncate(ex->out, file->size) < 0) res = -errno;
+    if (ex->out >= 0 && close(ex->out) < 0 && res == 0) res = -errno;
+    if (res < 0) fprintf(stderr, "sfs-export: %s: %s\n", host, strerror(-res));
+    free(host);
+    return res;
+}
+
+// directories are exported as the walk meets them, parents first; files are
+// only collected, to be streamed in block order afterwards
+static int on_entry(void *ctx, const char *path, const struct sfs_entry *entry,
+                    unsigned entry_off) {
+    (void)entry_off;
+    struct exporter *ex = ctx;
+
+    if (entry->size & SFS_DIRECTORY) {
+        ex->dirs++;
+        return export_dir(ex, path);
+    }
+
+    if (ex->nfiles == ex->files_cap) {
+        size_t cap = ex->files_cap ? ex->files_cap * 2 : 256;
+        struct export_file *grown = realloc(ex->files, cap * sizeof(*grown));
+        if (!grown) return -ENOMEM;
+        ex->files = grown;
+        ex->files_cap = cap;
+    }
+    struct export_file *file = &ex->files[ex->nfiles];
+    file->path = strdup(path);
+    if (!file->path) return -ENOMEM;
+    file->first_block = entry->first_block;
+    file->packed = ex->img->has_super && (ex->img->super.features & SFS_FEAT_SMALLFILE) &&
+                   (entry->size & SFS_PACKED);
+    file->size = file->packed ? SFS_PACK_LEN(entry->size) : entry->size & SFS_SIZEMASK;
+    file->pack_off = file->packed ? SFS_PACK_OFF(entry->size) : 0;
+    ex->nfiles++;
+    return 0;
+}
+
+static int by_block(const void *a, const void *b) {
+    const struct export_file *x = a, *y = b;
+    return (int)x->first_block - (int)y->first_block;
+}
+
+int main(int argc, char **argv) {
+    int opt;
+    const char *dest = NULL;
+    while ((opt = getopt(argc, argv, "C:")) != -1) {
+        if (opt == 'C') {
+            dest = optarg;
+        } else {
+            fprintf(stderr, "usage: %s [-C directory] image\n", argv[0]);
+            return 2;
+        }
+    }
+    if (optind + 1 != argc) {
+        fprintf(stderr, "usage: %s [-C directory] image\n", argv[0]);
+        return 2;
+    }
+    if (!dest && isatty(STDOUT_FILENO)) {
+        fprintf(stderr, "sfs-export: not writing an archive to a terminal\n");
+        return 2;
+    }
+
+    struct sfs_image img;
+    int res = sfs_image_open(&img, argv[optind], 0);
+    if (res < 0) {
+        fprintf(stderr, "sfs-export: %s: %s\n", argv[optind], strerror(-res));
+        return 1;
+    }
+
+    struct exporter ex = { .img = &img, .dest = dest, .out = STDOUT_FILENO };
+    struct sfs_walk_ops ops = { .entry = on_entry };
+    res = sfs_image_walk(&img, &ops, &ex);
+
+    qsort(ex.files, ex.nfiles, sizeof(*ex.files), by_block);
+    for (size_t i = 0; res == 0 && i < ex.nfiles; i++) {
+        res = export_file(&ex, &ex.files[i]);
+        ex.bytes += ex.files[i].size;
+    }
+
+    // two zero records end the archive
+    if (res == 0 && !dest) {
+        ex.out = STDOUT_FILENO;
+        res = put_data(&ex, NULL, 2 * TAR_BLOCK);
+    }
+
+    if (res < 0)
+        fprintf(stderr, "sfs-export: %s: %s\n", argv[optind], strerror(-res));
+    else
+        fprintf(stderr, "%s: %zu files, %lu directories, %llu bytes\n", argv[optind], ex.nfiles,
+                ex.dirs, ex.bytes);
+
+    for (size_t i = 0; i < ex.nfiles; i++) free(ex.files[i].path);
+    free(ex.files);
+    sfs_image_close(&img);
+    return res < 0 ? 1 : 0;
+}
@@ -0,0 +1,169 @@
+/* On-disk format extensions.
+   Images made by plain sfs-mkfs have none of these and work as before. An
+   extended image carries a superblock in the last data block and keeps the
+   blocks in front of it, down to meta_start, for extension metadata. Every
+   reserved block is marked with the end marker in the block table, so code
+   that only knows the table sees them as used.
+*/
+
+#ifndef SFS_FORMAT_H
+#define SFS_FORMAT_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "sfs.h"
+
+#define SFS_SUPER_MAGIC 0x58534653u // "SFSX"
+#define SFS_SUPER_VERSION 1
+#define SFS_SUPER_BLOCK (SFS_BLOCKTBL_NENTRIES - 1)
+
+// feature bits
+#define SFS_FEAT_FREELIST 0x1 // free blocks are kept on a linked list
+#define SFS_FEAT_SKIPIDX 0x2  // long chains carry a skip index block
+#define SFS_FEAT_TAIL 0x4     // the last block of every file is recorded
+#define SFS_FEAT_PACKDIR 0x8  // subdirectories hold packed variable length records
+#define SFS_FEAT_SMALLFILE 0x10 // files below SFS_PACK_MAX share pack blocks
+#define SFS_FEAT_SHADOW 0x20  // block table pages are updated copy on write
+
+// shadowed block table: the table is split into pages of SFS_TABLE_PAGE
+// bytes, and every page has a second copy in the reserved region. a bit in the
+// superblock's shadow_map says which copy of a page is current, the home copy
+// at SFS_BLOCKTBL_OFF or the shadow copy. changed pages are written to the
+// copy that is not current and the superblock write that flips their bits
+// switches to them at once, the superblock being smaller than a sector. a
+// cleanly unmounted image has every page current at home. it does not go with
+// SFS_FEAT_SMALLFILE, whose files move to new blocks as they grow: after a
+// crash the last commit would have the new block free and the data moved
+// into it would be lost
+#define SFS_TABLE_PAGE 4096
+#define SFS_TABLE_PAGE_ENTRIES (SFS_TABLE_PAGE / sizeof(blockidx_t))
+#define SFS_TABLE_PAGES \
+    ((SFS_BLOCKTBL_NENTRIES + SFS_TABLE_PAGE_ENTRIES - 1) / SFS_TABLE_PAGE_ENTRIES)
+#define SFS_TABLE_MAP_WORDS ((SFS_TABLE_PAGES + 31) / 32)
+#define SFS_SHADOW_BLOCKS \
+    (((size_t)SFS_TABLE_PAGES * SFS_TABLE_PAGE + SFS_BLOCK_SIZE - 1) / SFS_BLOCK_SIZE)
+
+// superblock states
+#define SFS_SUPER_CLEAN 0 // counters and list head are current
+#define SFS_SUPER_DIRTY 1 // mounted, or not unmounted cleanly
+
+struct sfs_super {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t features;
+    uint32_t state;
+    uint32_t meta_start;     // first reserved block, the region ends with the superblock
+    uint32_t freelink_start; // first block of the free list link array
+    uint32_t skipref_start;  // first block of the skip index references
+    uint32_t tailref_start;  // first block of the tail references
+    uint32_t free_head;      // first block on the free list, SFS_BLOCKIDX_END when empty
+    uint32_t free_blocks;
+    uint32_t entry_slots;
+    uint32_t used_entries;
+    uint32_t shadow_start;   // first block of the shadow table copy
+    uint32_t shadow_gen;     // commits of the shadowed table
+    uint32_t shadow_map[SFS_TABLE_MAP_WORDS]; // set where a page's shadow copy is current
+    uint32_t checksum;       // over the whole struct with this field zero
+};
+
+// free list links, one per block, doubly linked so any free block can be
+// taken off the list in constant time
+struct sfs_freelink {
+    blockidx_t prev;
+    blockidx_t next;
+};
+
+#define SFS_FREELINK_BLOCKS \
+    ((SFS_BLOCKTBL_NENTRIES * sizeof(struct sfs_freelink) + SFS_BLOCK_SIZE - 1) / SFS_BLOCK_SIZE)
+
+// skip index: one reference per block, set only at the first block of a file
+// that owns an index block, SFS_BLOCKIDX_EMPTY otherwise. entry i of the index
+// block is the block at chain position (i + 1) * SFS_SKIP_STRIDE, or
+// SFS_BLOCKIDX_EMPTY where none was recorded. entries at positions the file
+// size does not reach are stale and must be ignored
+#define SFS_SKIP_STRIDE 64
+#define SFS_SKIP_ENTRIES (SFS_BLOCK_SIZE / sizeof(blockidx_t))
+#define SFS_SKIPREF_BLOCKS \
+    ((SFS_BLOCKTBL_NENTRIES * sizeof(blockidx_t) + SFS_BLOCK_SIZE - 1) / SFS_BLOCK_SIZE)
+
+// tail references, one per block and meaningful at a file's first block: the
+// last block of the chain and the number of blocks in it, count 0 for none.
+// freeing a chain clears the reference at its first block; one whose block is
+// not marked as the end of a chain is stale and must be ignored
+struct sfs_tailref {
+    uint32_t count;
+    blockidx_t tail;
+};
+
+#define SFS_TAILREF_BLOCKS \
+    ((SFS_BLOCKTBL_NENTRIES * sizeof(struct sfs_tailref) + SFS_BLOCK_SIZE - 1) / SFS_BLOCK_SIZE)
+
+// packed directories: a subdirectory's entry array, the same contiguous
+// blocks a fixed array takes, is a run of records that covers it completely.
+// each record is rec_len bytes, a multiple of SFS_DIRREC_ALIGN, and its name
+// follows the header without a terminator. a record with name_len 0 is free
+// space. the root area keeps fixed entries
+struct sfs_dirrec {
+    uint32_t size;           // as in sfs_entry, directory flag included
+    blockidx_t first_block;
+    uint16_t rec_len;
+    uint8_t name_len;
+    char name[];
+};
+
+#define SFS_DIRREC_ALIGN 4
+#define SFS_DIRREC_LEN(name_len) \
+    ((offsetof(struct sfs_dirrec, name) + (name_len) + SFS_DIRREC_ALIGN - 1) & \
+     ~(size_t)(SFS_DIRREC_ALIGN - 1))
+#define SFS_DIRREC_AREA \
+    ((SFS_DIR_NENTRIES * sizeof(struct sfs_entry) + SFS_BLOCK_SIZE - 1) / SFS_BLOCK_SIZE * \
+     SFS_BLOCK_SIZE)
+#define SFS_DIRREC_MAX (SFS_DIRREC_AREA / SFS_DIRREC_LEN(1))
+
+// small file packing: a file shorter than SFS_PACK_MAX may live in a run of
+// fragments inside a shared pack block. its size field then has SFS_PACKED
+// set and carries the run's byte offset in the block next to the length, and
+// first_block names the pack block, which the table marks as a one block
+// chain. regular files stay below SFS_PACKED in size. fragment 0 of a pack
+// block holds the map of fragments in use
+#define SFS_PACKED 0x40000000u
+#define SFS_PACK_FRAG 32
+#define SFS_PACK_FRAGS (SFS_BLOCK_SIZE / SFS_PACK_FRAG)
+#define SFS_PACK_MAX (SFS_BLOCK_SIZE / 2)
+#define SFS_PACK_OFF(size) (((size) >> 16) & 0x3fffu)
+#define SFS_PACK_LEN(size) ((size) & 0xffffu)
+#define SFS_PACK_SIZE(off, len) (SFS_PACKED | (uint32_t)(off) << 16 | (uint32_t)(len))
+
+struct sfs_packmap {
+    uint32_t used[(SFS_PACK_FRAGS + 31) / 32]; // bit 0, the map itself, is always set
+};
+
+static inline uint32_t sfs_super_checksum(const struct sfs_super *super) {
+    struct sfs_super copy = *super;
+    copy.checksum = 0;
+
+    // FNV-1a
+    const unsigned char *p = (const unsigned char *)&copy;
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < sizeof(copy); i++) hash = (hash ^ p[i]) * 16777619u;
+    return hash;
+}
+
+// bytes of a table page, the last one may be short
+static inline size_t sfs_table_page_len(unsigned page) {
+    size_t left = SFS_BLOCKTBL_NENTRIES * sizeof(blockidx_t) - (size_t)page * SFS_TABLE_PAGE;
+    return left < SFS_TABLE_PAGE ? left : SFS_TABLE_PAGE;
+}
+
+static inline int sfs_shadow_current(const struct sfs_super *super, unsigned page) {
+    return (super->features & SFS_FEAT_SHADOW) &&
+           ((super->shadow_map[page / 32] >> (page % 32)) & 1);
+}
+
+static inline int sfs_super_valid(const struct sfs_super *super) {
+    return super->magic == SFS_SUPER_MAGIC && super->version == SFS_SUPER_VERSION &&
+           super->checksum == sfs_super_checksum(super) &&
+           super->meta_start <= SFS_SUPER_BLOCK;
+}
+
+#endif
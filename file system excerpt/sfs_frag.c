@@ -0,0 +1,271 @@
+/* sfs-frag: fragmentation and layout report for an unmounted sfs image.
+   Loads the root area and block table with one sequential read, walks the
+   directory tree in block order and follows every chain in memory. Reports
+   chain lengths and discontiguous runs per file, with a histogram of runs
+   per file, small files packed into shared blocks, the free space run length
+   histogram, blocks that are used but unreachable or reachable twice, and
+   how full the directories are.
+   With -j the directories are walked by a pool of threads, one task each.
+
+   usage: sfs-frag [-v] [-j threads] image
+*/
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "sfs_image.h"
+#include "sfs_pool.h"
+
+// power of two buckets for run length histograms
+#define NBUCKETS 17
+
+struct frag_stats {
+    struct sfs_image *img;
+    int verbose;
+    uint8_t *refs;              // references per block, saturating
+    uint8_t *packs;             // pack blocks already referenced
+    pthread_mutex_t lock;       // the counters below, for parallel walks
+
+    unsigned long files, dirs;
+    unsigned long empty_dirs;   // directories without blocks
+    unsigned long file_blocks;
+    unsigned long file_runs;
+    unsigned long fragmented;   // files with more than one run
+    unsigned long bad_chains;   // unterminated, looping or out of range
+    unsigned long sparse;       // chain ends before the size, the rest is a hole
+    unsigned long packed, pack_blocks;
+    unsigned long max_runs;
+    unsigned long run_hist[NBUCKETS];
+
+    unsigned long dir_slots, dir_used, full_dirs;
+};
+
+static unsigned bucket(unsigned long n) {
+    unsigned b = 0;
+    while (n > 1 && b < NBUCKETS - 1) { n >>= 1; b++; }
+    return b;
+}
+
+static void ref_block(struct frag_stats *st, blockidx_t block) {
+    uint8_t n = __atomic_load_n(&st->refs[block], __ATOMIC_RELAXED);
+    while (n < UINT8_MAX && !__atomic_compare_exchange_n(&st->refs[block], &n, n + 1, 0,
+                                                         __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+}
+
+// follow a chain in the in memory table, count blocks and runs.
+// returns 0 for a chain closed by the end marker, -1 otherwise
+static int walk_chain(struct frag_stats *st, blockidx_t first, unsigned long *blocks,
+                      unsigned long *runs) {
+    *blocks = 0;
+    *runs = 0;
+    blockidx_t prev = SFS_BLOCKIDX_END;
+    blockidx_t current = first;
+    while (current != SFS_BLOCKIDX_END) {
+        if (current >= SFS_BLOCKTBL_NENTRIES || current == SFS_BLOCKIDX_EMPTY) return -1;
+        if (*blocks >= SFS_BLOCKTBL_NENTRIES) return -1; // loop
+        if (prev == SFS_BLOCKIDX_END || current != prev + 1) (*runs)++;
+        ref_block(st, current);
+        (*blocks)++;
+        prev = current;
+        current = st->img->table[current];
+    }
+    return 0;
+}
+
+static int on_dir(void *ctx, const char *path, const struct sfs_entry *entries,
+                  unsigned nentries) {
+    struct frag_stats *st = ctx;
+    unsigned used = 0;
+    for (unsigned i = 0; i < nentries; i++)
+        if (entries[i].filename[0] != '\0') used++;
+
+    pthread_mutex_lock(&st->lock);
+    st->dir_slots += nentries;
+    st->dir_used += used;
+    if (used == nentries) st->full_dirs++;
+    if (st->verbose) printf("dir  %-40s %u/%u entries\n", path, used, nentries);
+    pthread_mutex_unlock(&st->lock);
+    return 0;
+}
+
+static int on_entry(void *ctx, const char *path, const struct sfs_entry *entry,
+                    unsigned entry_off) {
+    (void)entry_off;
+    struct frag_stats *st = ctx;
+    unsigned long blocks, runs;
+
+    if (entry->size & SFS_DIRECTORY) {
+        int bad = walk_chain(st, entry->first_block, &blocks, &runs) < 0;
+        pthread_mutex_lock(&st->lock);
+        st->dirs++;
+        if (entry->first_block == SFS_BLOCKIDX_END) st->empty_dirs++;
+        if (bad) st->bad_chains++;
+        pthread_mutex_unlock(&st->lock);
+        return 0;
+    }
+
+    if (st->img->has_super && (st->img->super.features & SFS_FEAT_SMALLFILE) &&
+        (entry->size & SFS_PACKED)) {
+        // files in one pack block share it, it is referenced once
+        blockidx_t block = entry->first_block;
+        int bad = block >= SFS_BLOCKTBL_NENTRIES || st->img->table[block] != SFS_BLOCKIDX_END;
+        int first = !bad && !__atomic_exchange_n(&st->packs[block], 1, __ATOMIC_RELAXED);
+        if (first) ref_block(st, block);
+
+        pthread_mutex_lock(&st->lock);
+        st->files++;
+        st->packed++;
+        if (bad) st->bad_chains++;
+        if (first) st->pack_blocks++;
+        if (st->verbose)
+            printf("file %-40s %10u bytes packed in block %u\n", path,
+                   (unsigned)SFS_PACK_LEN(entry->size), (unsigned)block);
+        pthread_mutex_unlock(&st->lock);
+        return 0;
+    }
+
+    uint32_t size = entry->size & SFS_SIZEMASK;
+    blockidx_t idx = sfs_image_skipidx(st->img, entry->first_block);
+    if (idx != SFS_BLOCKIDX_EMPTY && idx < SFS_BLOCKTBL_NENTRIES) ref_block(st, idx);
+    int res = walk_chain(st, entry->first_block, &blocks, &runs);
+
+    pthread_mutex_lock(&st->lock);
+    st->files++;
+    if (res < 0) st->bad_chains++;
+    if (blocks < (size + SFS_BLOCK_SIZE - 1) / SFS_BLOCK_SIZE) st->sparse++;
+
+    st->file_blocks += blocks;
+    st->file_runs += runs;
+    if (runs > 1) st->fragmented++;
+    if (runs > st->max_runs) st->max_runs = runs;
+    if (runs > 0) st->run_hist[bucket(runs)]++;
+
+    if (st->verbose)
+        printf("file %-40s %10u bytes %6lu blocks %5lu runs%s\n", path, size, blocks, runs,
+               res < 0 ? " (bad chain)" : "");
+    pthread_mutex_unlock(&st->lock);
+    return 0;
+}
+
+static void print_hist(const char *title, const unsigned long *hist) {
+    printf("%s\n", title);
+    for (unsigned b = 0; b < NBUCKETS; b++) {
+        if (hist[b] == 0) continue;
+        unsigned long lo = 1ul << b, hi = (2ul << b) - 1;
+        if (b == NBUCKETS - 1) printf("  %7lu+       %10lu\n", lo, hist[b]);
+        else printf("  %7lu-%-7lu %10lu\n", lo, hi, hist[b]);
+    }
+}
+
+int main(int argc, char **argv) {
+    int opt, verbose = 0;
+    unsigned threads = 1;
+    while ((opt = getopt(argc, argv, "vj:")) != -1) {
+        if (opt == 'v') {
+            verbose = 1;
+        } else if (opt == 'j') {
+            threads = (unsigned)atoi(optarg);
+        } else {
+            fprintf(stderr, "usage: %s [-v] [-j threads] image\n", argv[0]);
+            return 2;
+        }
+    }
+    if (optind + 1 != argc) {
+        fprintf(stderr, "usage: %s [-v] [-j threads] image\n", argv[0]);
+        return 2;
+    }
+
+    struct sfs_image img;
+    int res = sfs_image_open(&img, argv[optind], 0);
+    if (res < 0) {
+        fprintf(stderr, "sfs-frag: %s: %s\n", argv[optind], strerror(-res));
+        return 1;
+    }
+
+    struct frag_stats st = { .img = &img, .verbose = verbose };
+    pthread_mutex_init(&st.lock, NULL);
+    st.refs = calloc(SFS_BLOCKTBL_NENTRIES, 1);
+    st.packs = calloc(SFS_BLOCKTBL_NENTRIES, 1);
+    if (!st.refs || !st.packs) {
+        free(st.refs);
+        free(st.packs);
+        sfs_image_close(&img);
+        fprintf(stderr, "sfs-frag: out of memory\n");
+        return 1;
+    }
+
+    // one thread keeps the walk in block order; -j 0 is one per CPU
+    struct sfs_walk_ops ops = { .dir = on_dir, .entry = on_entry };
+    if (threads == 1) {
+        res = sfs_image_walk(&img, &ops, &st);
+    } else {
+        struct sfs_pool *pool = sfs_pool_create(threads);
+        res = pool ? sfs_image_walk_parallel(&img, pool, "/", &ops, &st) : -ENOMEM;
+        if (pool) sfs_pool_destroy(pool);
+    }
+    if (res < 0) {
+        fprintf(stderr, "sfs-frag: walking %s: %s\n", argv[optind], strerror(-res));
+        free(st.refs);
+        free(st.packs);
+        sfs_image_close(&img);
+        return 1;
+    }
+
+    // one pass over the table for free runs, leaks and cross links
+    unsigned long free_blocks = 0, used_blocks = 0, reserved = 0, leaked = 0, crosslinked = 0;
+    unsigned long free_hist[NBUCKETS] = {0};
+    unsigned long run = 0;
+    for (unsigned i = 0; i <= SFS_BLOCKTBL_NENTRIES; i++) {
+        int is_free = i < SFS_BLOCKTBL_NENTRIES && i != SFS_BLOCKIDX_EMPTY &&
+                      img.table[i] == SFS_BLOCKIDX_EMPTY;
+        if (is_free) {
+            free_blocks++;
+            run++;
+            continue;
+        }
+        if (run > 0) free_hist[bucket(run)]++;
+        run = 0;
+        if (i == SFS_BLOCKTBL_NENTRIES) continue;
+
+        used_blocks++;
+        if (sfs_image_reserved(&img, i)) {
+            reserved++;
+            continue;
+        }
+        if (st.refs[i] == 0) leaked++;
+        if (st.refs[i] > 1) crosslinked++;
+    }
+
+    printf("image          %s\n", argv[optind]);
+    printf("blocks         %u total, %lu used (%lu reserved), %lu free\n",
+           (unsigned)SFS_BLOCKTBL_NENTRIES, used_blocks, reserved, free_blocks);
+    if (img.has_super)
+        printf("superblock     features %#x, %s, %u free recorded\n", img.super.features,
+               img.super.state == SFS_SUPER_CLEAN ? "clean" : "dirty", img.super.free_blocks);
+    printf("files          %lu, %lu blocks, %lu fragmented (%.1f%%)\n", st.files,
+           st.file_blocks, st.fragmented,
+           st.files ? 100.0 * st.fragmented / st.files : 0.0);
+    if (st.packed > 0)
+        printf("packed files   %lu in %lu pack blocks\n", st.packed, st.pack_blocks);
+    printf("runs per file  %.2f average, %lu worst\n",
+           st.files ? (double)st.file_runs / st.files : 0.0, st.max_runs);
+    printf("directories    %lu (%lu without blocks), %lu/%lu slots used (%.1f%%), %lu full\n",
+           st.dirs, st.empty_dirs, st.dir_used, st.dir_slots,
+           st.dir_slots ? 100.0 * st.dir_used / st.dir_slots : 0.0, st.full_dirs);
+    printf("leaked blocks  %lu\n", leaked);
+    printf("cross linked   %lu\n", crosslinked);
+    printf("bad chains     %lu\n", st.bad_chains);
+    printf("sparse tails   %lu\n", st.sparse);
+    print_hist("runs per file (runs  files)", st.run_hist);
+    print_hist("free runs (blocks  count)", free_hist);
+
+    free(st.refs);
+    free(st.packs);
+    sfs_image_close(&img);
+    return 0;
+}
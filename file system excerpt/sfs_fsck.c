@@ -0,0 +1,462 @@
+/* sfs-fsck: check an unmounted sfs image, and with -r repair it.
+   The block table is loaded with one sequential read and every chain is
+   followed in memory; only the directory arrays and the reserved region
+   are read besides, so a check costs about one pass over the metadata,
+   whatever the amount of file data. With -j the directories are walked by
+   a pool of threads, one task per directory.
+
+   Every block is claimed by the first chain that reaches it. A chain is cut
+   before a block it cannot keep: one another chain claimed first, one it
+   already passed (a loop), a free or reserved block, or a link outside the
+   table. A file whose first block is unusable keeps its size with no blocks,
+   so it reads as zeros; a directory loses its entries, whose blocks then
+   count as leaked. Used blocks no chain reaches are freed. Packed files are
+   checked against their pack block's fragment map, skip index and tail
+   references against the chains they describe.
+
+   Repairs go to the table in memory and are written back at the end; an
+   image with a superblock is marked dirty, so the next mount rebuilds the
+   free list and the counters.
+
+   usage: sfs-fsck [-r] [-j threads] image
+   exit status: 0 clean, 1 problems repaired, 4 problems left, 8 failure
+*/
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "sfs_image.h"
+#include "sfs_pool.h"
+
+// owner of a pack block, shared by the files packed into it
+#define OWNER_PACK UINT32_MAX
+
+// an entry to write back with a new size and first block
+struct entry_fix {
+    unsigned entry_off;
+    uint32_t size;
+    blockidx_t first_block;
+};
+
+struct packed_file {
+    char *path;
+    unsigned entry_off;
+    blockidx_t block;
+    unsigned off, len;
+};
+
+struct checker {
+    struct sfs_image *img;
+    uint32_t *owner;             // entry offset + 1 of the chain holding each block
+    struct sfs_tailref *tailrefs; // with SFS_FEAT_TAIL
+    int skip_dirty, tail_dirty;
+
+    pthread_mutex_t lock;        // everything below
+    unsigned long files, dirs, problems;
+    struct entry_fix *fixes;
+    size_t nfixes, fixes_cap;
+    struct packed_file *packed;
+    size_t npacked, packed_cap;
+};
+
+static void problem(struct checker *ck, const char *path, const char *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    pthread_mutex_lock(&ck->lock);
+    ck->problems++;
+    printf("%s: ", path);
+    vprintf(fmt, ap);
+    printf("\n");
+    pthread_mutex_unlock(&ck->lock);
+    va_end(ap);
+}
+
+static int grow(void **array, size_t *cap, size_t len, size_t size) {
+    if (len < *cap) return 0;
+    size_t new_cap = *cap ? *cap * 2 : 64;
+    void *grown = realloc(*array, new_cap * size);
+    if (!grown) return -ENOMEM;
+    *array = grown;
+    *cap = new_cap;
+    return 0;
+}
+
+static int add_fix(struct checker *ck, unsigned entry_off, uint32_t size, blockidx_t first_block) {
+    pthread_mutex_lock(&ck->lock);
+    int res = grow((void **)&ck->fixes, &ck->fixes_cap, ck->nfixes, sizeof(*ck->fixes));
+    if (res == 0) ck->fixes[ck->nfixes++] = (struct entry_fix){ entry_off, size, first_block };
+    pthread_mutex_unlock(&ck->lock);
+    return res;
+}
+
+// claim a block for owner, returns the owner it already had, 0 for none
+static uint32_t claim(struct checker *ck, blockidx_t block, uint32_t owner) {
+    uint32_t was = 0;
+    __atomic_compare_exchange_n(&ck->owner[block], &was, owner, 0, __ATOMIC_RELAXED,
+                                __ATOMIC_RELAXED);
+    return was;
+}
+
+// follow the chain at first claiming its blocks for owner, and cut it before
+// the first block it cannot keep. chains hold disjoint blocks once claimed,
+// so parallel callers write disjoint table entries. sets last and count to
+// the chain's tail and length; returns -1 when not even the first block
+// could be kept, 1 when the chain was cut, 0 when it is intact
+static int check_chain(struct checker *ck, const char *path, blockidx_t first, uint32_t owner,
+                       blockidx_t *last, unsigned *count) {
+    struct sfs_image *img = ck->img;
+    blockidx_t prev = SFS_BLOCKIDX_END, block = first;
+    *count = 0;
+    while (block != SFS_BLOCKIDX_END) {
+        const char *why = NULL;
+        uint32_t was;
+        if (block >= SFS_BLOCKTBL_NENTRIES || block == SFS_BLOCKIDX_EMPTY)
+            why = "is not terminated";
+        else if (sfs_image_reserved(img, block))
+            why = "runs into the reserved region";
+        else if (img->table[block] == SFS_BLOCKIDX_EMPTY)
+            why = "runs into a free block";
+        else if ((was = claim(ck, block, owner)) == owner)
+            why = "loops";
+        else if (was != 0)
+            why = "is cross linked with another chain";
+
+        if (why) {
+            if (prev == SFS_BLOCKIDX_END) {
+                problem(ck, path, "bad first block %u", (unsigned)block);
+                return -1;
+            }
+            problem(ck, path, "chain %s after block %u, cut there", why, (unsigned)prev);
+            img->table[prev] = SFS_BLOCKIDX_END;
+            *last = prev;
+            return 1;
+        }
+        prev = block;
+        (*count)++;
+        block = img->table[block];
+    }
+    *last = prev;
+    return 0;
+}
+
+// whether every pointer in the skip index block idx names the block at its
+// chain position, or is empty. pointers past the chain must be empty, as
+// lookups trust them up to the file size
+static int skip_index_matches(struct checker *ck, blockidx_t head, blockidx_t idx) {
+    struct sfs_image *img = ck->img;
+    blockidx_t ptrs[SFS_SKIP_ENTRIES];
+    if (sfs_image_read(img, ptrs, sizeof(ptrs),
+                       SFS_DATA_OFF + (off_t)idx * SFS_BLOCK_SIZE) < 0)
+        return 0;
+
+    blockidx_t block = head;
+    unsigned pos = 0;
+    for (unsigned i = 0; i < SFS_SKIP_ENTRIES; i++) {
+        while (block != SFS_BLOCKIDX_END && pos < (i + 1) * SFS_SKIP_STRIDE) {
+            block = img->table[block];
+            pos++;
+        }
+        if (ptrs[i] != SFS_BLOCKIDX_EMPTY && ptrs[i] != block) return 0;
+    }
+    return 1;
+}
+
+// check a regular file's chain, then its skip index and tail reference. a
+// cut chain loses its skip index, whose pointers past the cut would lead
+// into other chains
+static int check_file(struct checker *ck, const char *path, const struct sfs_entry *entry,
+                      unsigned entry_off) {
+    struct sfs_image *img = ck->img;
+    blockidx_t head = entry->first_block;
+    if (head == SFS_BLOCKIDX_END) return 0;
+
+    blockidx_t last;
+    unsigned count;
+    int res = check_chain(ck, path, head, entry_off + 1, &last, &count);
+    if (res < 0) return add_fix(ck, entry_off, entry->size, SFS_BLOCKIDX_END);
+
+    blockidx_t idx = sfs_image_skipidx(img, head);
+    if (idx != SFS_BLOCKIDX_EMPTY) {
+        int keep = res == 0 && idx < SFS_BLOCKTBL_NENTRIES && !sfs_image_reserved(img, idx) &&
+                   img->table[idx] == SFS_BLOCKIDX_END && skip_index_matches(ck, head, idx) &&
+                   claim(ck, idx, entry_off + 1) == 0;
+        if (!keep) {
+            if (res == 0) problem(ck, path, "bad skip index block %u, dropped", (unsigned)idx);
+            img->skiprefs[head] = SFS_BLOCKIDX_EMPTY;
+            ck->skip_dirty = 1;
+        }
+    }
+
+    if (ck->tailrefs) {
+        struct sfs_tailref *ref = &ck->tailrefs[head];
+        if (ref->count != 0 && (ref->tail != last || ref->count != count)) {
+            if (res == 0) problem(ck, path, "stale tail reference, corrected");
+            ref->tail = last;
+            ref->count = count;
+            ck->tail_dirty = 1;
+        }
+    }
+    return 0;
+}
+
+static int check_packed(struct checker *ck, const char *path, const struct sfs_entry *entry,
+                        unsigned entry_off) {
+    struct sfs_image *img = ck->img;
+    blockidx_t block = entry->first_block;
+    unsigned off = SFS_PACK_OFF(entry->size), len = SFS_PACK_LEN(entry->size);
+
+    const char *why = NULL;
+    uint32_t was;
+    if (block >= SFS_BLOCKTBL_NENTRIES || block == SFS_BLOCKIDX_EMPTY ||
+        sfs_image_reserved(img, block) || img->table[block] != SFS_BLOCKIDX_END)
+        why = "bad pack block";
+    else if (off < SFS_PACK_FRAG || off % SFS_PACK_FRAG || len == 0 || len >= SFS_PACK_MAX ||
+             off + len > SFS_BLOCK_SIZE)
+        why = "bad packed run";
+    else if ((was = claim(ck, block, OWNER_PACK)) != 0 && was != OWNER_PACK)
+        why = "pack block cross linked with a chain";
+    if (why) {
+        problem(ck, path, "%s, file emptied", why);
+        return add_fix(ck, entry_off, 0, SFS_BLOCKIDX_END);
+    }
+
+    pthread_mutex_lock(&ck->lock);
+    int res = grow((void **)&ck->packed, &ck->packed_cap, ck->npacked, sizeof(*ck->packed));
+    char *copy = res == 0 ? strdup(path) : NULL;
+    if (copy)
+        ck->packed[ck->npacked++] = (struct packed_file){ copy, entry_off, block, off, len };
+    pthread_mutex_unlock(&ck->lock);
+    return copy ? 0 : -ENOMEM;
+}
+
+static int on_entry(void *ctx, const char *path, const struct sfs_entry *entry,
+                    unsigned entry_off) {
+    struct checker *ck = ctx;
+    struct sfs_image *img = ck->img;
+
+    pthread_mutex_lock(&ck->lock);
+    if (entry->size & SFS_DIRECTORY) ck->dirs++;
+    else ck->files++;
+    pthread_mutex_unlock(&ck->lock);
+
+    if (entry->size & SFS_DIRECTORY) {
+        if (entry->first_block == SFS_BLOCKIDX_END) return 0;
+        blockidx_t last;
+        unsigned count;
+        if (check_chain(ck, path, entry->first_block, entry_off + 1, &last, &count) >= 0)
+            return 0;
+        // the walk must not read a directory array from blocks it does not own
+        int res = add_fix(ck, entry_off, entry->size, SFS_BLOCKIDX_END);
+        return res < 0 ? res : SFS_WALK_SKIP;
+    }
+
+    if (img->has_super && (img->super.features & SFS_FEAT_SMALLFILE) &&
+        (entry->size & SFS_PACKED))
+        return check_packed(ck, path, entry, entry_off);
+    return check_file(ck, path, entry, entry_off);
+}
+
+static int by_run(const void *a, const void *b) {
+    const struct packed_file *x = a, *y = b;
+    if (x->block != y->block) return (int)x->block - (int)y->block;
+    return (int)x->off - (int)y->off;
+}
+
+// rebuild each pack block's fragment map from the files packed into it. a
+// file overlapping the run of the one before it is emptied
+static int check_pack_maps(struct checker *ck, int repair) {
+    struct sfs_image *img = ck->img;
+    if (ck->npacked > 0) qsort(ck->packed, ck->npacked, sizeof(*ck->packed), by_run);
+
+    for (size_t i = 0; i < ck->npacked;) {
+        blockidx_t block = ck->packed[i].block;
+        struct sfs_packmap want;
+        memset(&want, 0, sizeof(want));
+        want.used[0] = 1; // fragment 0 holds the map
+
+        for (; i < ck->npacked && ck->packed[i].block == block; i++) {
+            struct packed_file *file = &ck->packed[i];
+            unsigned first = file->off / SFS_PACK_FRAG;
+            unsigned n = (file->len + SFS_PACK_FRAG - 1) / SFS_PACK_FRAG;
+            int overlap = 0;
+            for (unsigned f = first; f < first + n; f++)
+                overlap |= (want.used[f / 32] >> (f % 32)) & 1;
+            if (overlap) {
+                problem(ck, file->path, "packed run overlaps another file, file emptied");
+                int res = add_fix(ck, file->entry_off, 0, SFS_BLOCKIDX_END);
+                if (res < 0) return res;
+                continue;
+            }
+            for (unsigned f = first; f < first + n; f++) want.used[f / 32] |= 1u << (f % 32);
+        }
+
+        off_t map_off = SFS_DATA_OFF + (off_t)block * SFS_BLOCK_SIZE;
+        struct sfs_packmap map;
+        int res = sfs_image_read(img, &map, sizeof(map), map_off);
+        if (res < 0) return res;
+        if (memcmp(&map, &want, sizeof(map)) == 0) continue;
+
+        char name[32];
+        snprintf(name, sizeof(name), "pack block %u", (unsigned)block);
+        problem(ck, name, "fragment map does not match its files, rebuilt");
+        if (repair) {
+            res = sfs_image_write(img, &want, sizeof(want), map_off);
+            if (res < 0) return res;
+        }
+    }
+    return 0;
+}
+
+// free used blocks no chain reached, and drop skip index and tail references
+// left at free blocks, which a new chain starting there would pick up
+static void check_leaks(struct checker *ck) {
+    struct sfs_image *img = ck->img;
+    unsigned long leaked = 0, stale = 0;
+    for (unsigned b = 0; b < SFS_BLOCKTBL_NENTRIES; b++) {
+        if (sfs_image_reserved(img, b)) continue;
+        if (img->table[b] != SFS_BLOCKIDX_EMPTY && ck->owner[b] == 0) {
+            img->table[b] = SFS_BLOCKIDX_EMPTY;
+            leaked++;
+        }
+        if (img->table[b] != SFS_BLOCKIDX_EMPTY) continue;
+        if (img->skiprefs && img->skiprefs[b] != SFS_BLOCKIDX_EMPTY) {
+            img->skiprefs[b] = SFS_BLOCKIDX_EMPTY;
+            ck->skip_dirty = 1;
+            stale++;
+        }
+        if (ck->tailrefs && ck->tailrefs[b].count != 0) {
+            ck->tailrefs[b].count = 0;
+            ck->tail_dirty = 1;
+        }
+    }
+    if (leaked > 0) problem(ck, "table", "%lu leaked blocks, freed", leaked);
+    if (stale > 0) problem(ck, "table", "%lu skip index references at free blocks, dropped", stale);
+}
+
+// write back the entry fixes, then the table and the references
+static int write_repairs(struct checker *ck) {
+    struct sfs_image *img = ck->img;
+    int packdir = img->has_super && (img->super.features & SFS_FEAT_PACKDIR);
+    int res = 0;
+
+    for (size_t i = 0; res == 0 && i < ck->nfixes; i++) {
+        const struct entry_fix *fix = &ck->fixes[i];
+        size_t size_at = offsetof(struct sfs_entry, size);
+        size_t block_at = offsetof(struct sfs_entry, first_block);
+        if (packdir && fix->entry_off >= SFS_DATA_OFF) {
+            size_at = offsetof(struct sfs_dirrec, size);
+            block_at = offsetof(struct sfs_dirrec, first_block);
+        }
+        res = sfs_image_write(img, &fix->size, sizeof(fix->size), fix->entry_off + size_at);
+        if (res == 0)
+            res = sfs_image_write(img, &fix->first_block, sizeof(fix->first_block),
+                                  fix->entry_off + block_at);
+    }
+
+    if (res == 0)
+        res = sfs_image_write(img, img->table, SFS_BLOCKTBL_NENTRIES * sizeof(blockidx_t),
+                              SFS_BLOCKTBL_OFF);
+    if (res == 0 && ck->skip_dirty)
+        res = sfs_image_write(img, img->skiprefs, SFS_BLOCKTBL_NENTRIES * sizeof(blockidx_t),
+                              SFS_DATA_OFF + (off_t)img->super.skipref_start * SFS_BLOCK_SIZE);
+    if (res == 0 && ck->tail_dirty)
+        res = sfs_image_write(img, ck->tailrefs,
+                              SFS_BLOCKTBL_NENTRIES * sizeof(struct sfs_tailref),
+                              SFS_DATA_OFF + (off_t)img->super.tailref_start * SFS_BLOCK_SIZE);
+    return res;
+}
+
+static int mark_dirty(struct sfs_image *img) {
+    img->super.state = SFS_SUPER_DIRTY;
+    img->super.checksum = sfs_super_checksum(&img->super);
+    return sfs_image_write(img, &img->super, sizeof(img->super),
+                           SFS_DATA_OFF + (off_t)SFS_SUPER_BLOCK * SFS_BLOCK_SIZE);
+}
+
+static int check(struct checker *ck, unsigned threads, int repair) {
+    struct sfs_image *img = ck->img;
+    int res = 0;
+    if (img->has_super && (img->super.features & SFS_FEAT_TAIL)) {
+        ck->tailrefs = malloc(SFS_BLOCKTBL_NENTRIES * sizeof(struct sfs_tailref));
+        res = ck->tailrefs ? 0 : -ENOMEM;
+        if (res == 0)
+            res = sfs_image_read(img, ck->tailrefs,
+                                 SFS_BLOCKTBL_NENTRIES * sizeof(struct sfs_tailref),
+                                 SFS_DATA_OFF + (off_t)img->super.tailref_start * SFS_BLOCK_SIZE);
+        if (res < 0) return res;
+    }
+
+    // one thread keeps the walk in block order; -j 0 is one per CPU
+    struct sfs_walk_ops ops = { .entry = on_entry };
+    if (threads == 1) {
+        res = sfs_image_walk(img, &ops, ck);
+    } else {
+        struct sfs_pool *pool = sfs_pool_create(threads);
+        res = pool ? sfs_image_walk_parallel(img, pool, "/", &ops, ck) : -ENOMEM;
+        if (pool) sfs_pool_destroy(pool);
+    }
+    if (res == 0) res = check_pack_maps(ck, repair);
+    if (res < 0) return res;
+    check_leaks(ck);
+
+    if (!repair || ck->problems == 0) return 0;
+    res = img->has_super ? mark_dirty(img) : 0;
+    return res < 0 ? res : write_repairs(ck);
+}
+
+int main(int argc, char **argv) {
+    int opt, repair = 0;
+    unsigned threads = 1;
+    while ((opt = getopt(argc, argv, "rj:")) != -1) {
+        if (opt == 'r') {
+            repair = 1;
+        } else if (opt == 'j') {
+            threads = (unsigned)atoi(optarg);
+        } else {
+            fprintf(stderr, "usage: %s [-r] [-j threads] image\n", argv[0]);
+            return 8;
+        }
+    }
+    if (optind + 1 != argc) {
+        fprintf(stderr, "usage: %s [-r] [-j threads] image\n", argv[0]);
+        return 8;
+    }
+
+    struct sfs_image img;
+    int res = sfs_image_open(&img, argv[optind], repair);
+    if (res < 0) {
+        fprintf(stderr, "sfs-fsck: %s: %s\n", argv[optind], strerror(-res));
+        return 8;
+    }
+
+    struct checker ck = { .img = &img };
+    pthread_mutex_init(&ck.lock, NULL);
+    ck.owner = calloc(SFS_BLOCKTBL_NENTRIES, sizeof(uint32_t));
+    res = ck.owner ? check(&ck, threads, repair) : -ENOMEM;
+
+    int status = 0;
+    if (res < 0) {
+        fprintf(stderr, "sfs-fsck: %s: %s\n", argv[optind], strerror(-res));
+        status = 8;
+    } else {
+        printf("%s: %lu files, %lu directories, %lu problems%s\n", argv[optind], ck.files,
+               ck.dirs, ck.problems,
+               ck.problems == 0 ? "" : repair ? ", repaired" : ", run with -r to repair");
+        status = ck.problems == 0 ? 0 : repair ? 1 : 4;
+    }
+
+    for (size_t i = 0; i < ck.npacked; i++) free(ck.packed[i].path);
+    free(ck.packed);
+    free(ck.fixes);
+    free(ck.tailrefs);
+    free(ck.owner);
+    pthread_mutex_destroy(&ck.lock);
+    sfs_image_close(&img);
+    return status;
+}
@@ -0,0 +1,490 @@
+/* Offline access to sfs images, see sfs_image.h */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "sfs_image.h"
+#include "sfs_pool.h"
+
+int sfs_image_read(struct sfs_image *img, void *buf, size_t size, off_t offset) {
+    char *p = buf;
+    while (size > 0) {
+        ssize_t n = pread(img->fd, p, size, offset);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) return -errno;
+        if (n == 0) {
+            // past the end of a short image reads as zeroes
+            memset(p, 0, size);
+            return 0;
+        }
+        p += n;
+        size -= (size_t)n;
+        offset += n;
+    }
+    return 0;
+}
+
+int sfs_image_write(struct sfs_image *img, const void *buf, size_t size, off_t offset) {
+    const char *p = buf;
+    while (size > 0) {
+        ssize_t n = pwrite(img->fd, p, size, offset);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) return -errno;
+        p += n;
+        size -= (size_t)n;
+        offset += n;
+    }
+    return 0;
+}
+
+int sfs_image_open(struct sfs_image *img, const char *path, int writable) {
+    memset(img, 0, sizeof(*img));
+    img->fd = open(path, writable ? O_RDWR : O_RDONLY);
+    if (img->fd < 0) return -errno;
+
+    struct stat st;
+    if (fstat(img->fd, &st) < 0) {
+        int res = -errno;
+        close(img->fd);
+        return res;
+    }
+    if (st.st_size < (off_t)SFS_DATA_OFF) {
+        close(img->fd);
+        return -EINVAL;
+    }
+    img->size = st.st_size;
+
+    img->rootdir = malloc(SFS_ROOTDIR_NENTRIES * sizeof(struct sfs_entry));
+    img->table = malloc(SFS_BLOCKTBL_NENTRIES * sizeof(blockidx_t));
+    if (!img->rootdir || !img->table) {
+        sfs_image_close(img);
+        return -ENOMEM;
+    }
+
+    // root area and table sit back to back in front of the data region
+    int res = sfs_image_read(img, img->rootdir,
+                             SFS_ROOTDIR_NENTRIES * sizeof(struct sfs_entry), SFS_ROOTDIR_OFF);
+    if (res == 0)
+        res = sfs_image_read(img, img->table,
+                             SFS_BLOCKTBL_NENTRIES * sizeof(blockidx_t), SFS_BLOCKTBL_OFF);
+    if (res < 0) {
+        sfs_image_close(img);
+        return res;
+    }
+
+    // a superblock is only believed when its block is marked used
+    if (img->table[SFS_SUPER_BLOCK] == SFS_BLOCKIDX_END) {
+        res = sfs_image_read(img, &img->super, sizeof(img->super),
+                             SFS_DATA_OFF + (off_t)SFS_SUPER_BLOCK * SFS_BLOCK_SIZE);
+        if (res < 0) {
+            sfs_image_close(img);
+            return res;
+        }
+        img->has_super = sfs_super_valid(&img->super);
+    }
+
+    // pages whose shadow copy is current, left so by a crash, replace their
+    // home copy. a tool that may write the table gets them folded home first,
+    // so its whole table writes and a superblock with an empty map agree
+    if (img->has_super && (img->super.features & SFS_FEAT_SHADOW)) {
+        int folded = 0;
+        for (unsigned p = 0; res == 0 && p < SFS_TABLE_PAGES; p++) {
+            if (!sfs_shadow_current(&img->super, p)) continue;
+            res = sfs_image_read(img, (char *)img->table + (size_t)p * SFS_TABLE_PAGE,
+                                 sfs_table_page_len(p),
+                                 SFS_DATA_OFF + (off_t)img->super.shadow_start * SFS_BLOCK_SIZE +
+                                     (off_t)p * SFS_TABLE_PAGE);
+            folded = 1;
+        }
+        if (res == 0 && writable && folded) {
+            res = sfs_image_write(img, img->table, SFS_BLOCKTBL_NENTRIES * sizeof(blockidx_t),
+                                  SFS_BLOCKTBL_OFF);
+            if (res == 0 && fsync(img->fd) < 0) res = -errno;
+            memset(img->super.shadow_map, 0, sizeof(img->super.shadow_map));
+            img->super.checksum = sfs_super_checksum(&img->super);
+            if (res == 0)
+                res = sfs_image_write(img, &img->super, sizeof(img->super),
+                                      SFS_DATA_OFF + (off_t)SFS_SUPER_BLOCK * SFS_BLOCK_SIZE);
+        }
+        if (res < 0) {
+            sfs_image_close(img);
+            return res;
+        }
+    }
+
+    if (img->has_super && (img->super.features & SFS_FEAT_SKIPIDX)) {
+        img->skiprefs = malloc(SFS_BLOCKTBL_NENTRIES * sizeof(blockidx_t));
+        res = img->skiprefs ? 0 : -ENOMEM;
+        if (res == 0)
+            res = sfs_image_read(img, img->skiprefs, SFS_BLOCKTBL_NENTRIES * sizeof(blockidx_t),
+                                 SFS_DATA_OFF + (off_t)img->super.skipref_start * SFS_BLOCK_SIZE);
+        if (res < 0) {
+            sfs_image_close(img);
+            return res;
+        }
+    }
+    return 0;
+}
+
+int sfs_image_reserved(const struct sfs_image *img, blockidx_t block) {
+    if (block == SFS_BLOCKIDX_EMPTY) return 1;
+    return img->has_super && block >= img->super.meta_start && block <= SFS_SUPER_BLOCK;
+}
+
+blockidx_t sfs_image_skipidx(const struct sfs_image *img, blockidx_t head) {
+    if (!img->skiprefs || head >= SFS_BLOCKTBL_NENTRIES) return SFS_BLOCKIDX_EMPTY;
+    return img->skiprefs[head];
+}
+
+void sfs_image_close(struct sfs_image *img) {
+    free(img->rootdir);
+    free(img->table);
+    free(img->skiprefs);
+    if (img->fd >= 0) close(img->fd);
+    img->rootdir = NULL;
+    img->table = NULL;
+    img->skiprefs = NULL;
+    img->fd = -1;
+}
+
+// decode a packed array into entries, free records included so a directory
+// reports its record count. a damaged record ends the array
+static unsigned decode_packed(const char *area, struct sfs_entry *entries, unsigned *offsets) {
+    unsigned n = 0;
+    for (unsigned pos = 0; pos + SFS_DIRREC_LEN(0) <= SFS_DIRREC_AREA && n < SFS_DIRREC_MAX; ) {
+        struct sfs_dirrec rec;
+        memcpy(&rec, area + pos, offsetof(struct sfs_dirrec, name));
+        if (rec.rec_len < SFS_DIRREC_LEN(0) || rec.rec_len > SFS_DIRREC_AREA - pos ||
+            rec.rec_len % SFS_DIRREC_ALIGN)
+            break;
+
+        memset(&entries[n], 0, sizeof(entries[n]));
+        entries[n].first_block = SFS_BLOCKIDX_EMPTY;
+        if (rec.name_len > 0 && rec.name_len < SFS_FILENAME_MAX &&
+            SFS_DIRREC_LEN(rec.name_len) <= rec.rec_len) {
+            memcpy(entries[n].filename, area + pos + offsetof(struct sfs_dirrec, name),
+                   rec.name_len);
+            entries[n].first_block = rec.first_block;
+            entries[n].size = rec.size;
+        }
+        offsets[n++] = pos;
+        pos += rec.rec_len;
+    }
+    return n;
+}
+
+int sfs_image_read_dir(struct sfs_image *img, blockidx_t first_block,
+                       struct sfs_entry *entries, unsigned *offsets) {
+    if (first_block >= SFS_BLOCKTBL_NENTRIES) return -EINVAL;
+    off_t dir_off = SFS_DATA_OFF + (off_t)first_block * SFS_BLOCK_SIZE;
+
+    if (img->has_super && (img->super.features & SFS_FEAT_PACKDIR)) {
+        char area[SFS_DIRREC_AREA];
+        int res = sfs_image_read(img, area, sizeof(area), dir_off);
+        if (res < 0) return res;
+        unsigned n = decode_packed(area, entries, offsets);
+        for (unsigned i = 0; i < n; i++) offsets[i] += (unsigned)dir_off;
+        return (int)n;
+    }
+
+    int res = sfs_image_read(img, entries, SFS_DIR_NENTRIES * sizeof(struct sfs_entry), dir_off);
+    if (res < 0) return res;
+    for (unsigned i = 0; i < SFS_DIR_NENTRIES; i++)
+        offsets[i] = (unsigned)dir_off + i * (unsigned)sizeof(struct sfs_entry);
+    return SFS_DIR_NENTRIES;
+}
+
+struct pending_dir {
+    char *path;
+    blockidx_t first_block;
+};
+
+static int by_block(const void *a, const void *b) {
+    const struct pending_dir *x = a, *y = b;
+    return (int)x->first_block - (int)y->first_block;
+}
+
+static char *join_path(const char *dir, const char *name) {
+    size_t dir_len = strcmp(dir, "/") == 0 ? 0 : strlen(dir);
+    char *path = malloc(dir_len + strlen(name) + 2);
+    if (!path) return NULL;
+    memcpy(path, dir, dir_len);
+    path[dir_len] = '/';
+    strcpy(path + dir_len + 1, name);
+    return path;
+}
+
+// where visit_dir hands the subdirectories it finds
+typedef int (*queue_fn)(void *queue, char *path, blockidx_t first_block);
+
+// report a directory's entries and queue its subdirectories. seen is shared
+// by parallel walks, so a directory is claimed with an atomic exchange
+static int visit_dir(const struct sfs_walk_ops *ops, void *ctx, const char *path,
+                     const struct sfs_entry *entries, const unsigned *offsets,
+                     unsigned nentries, uint8_t *seen, queue_fn queue, void *queue_ctx) {
+    if (ops->dir) {
+        int res = ops->dir(ctx, path, entries, nentries);
+        if (res) return res;
+    }
+
+    for (unsigned i = 0; i < nentries; i++) {
+        char name[SFS_FILENAME_MAX];
+        memcpy(name, entries[i].filename, SFS_FILENAME_MAX);
+        name[SFS_FILENAME_MAX - 1] = '\0';
+        if (strlen(name) == 0) continue;
+
+        char *child = join_path(path, name);
+        if (!child) return -ENOMEM;
+
+        int skip = 0;
+        if (ops->entry) {
+            int res = ops->entry(ctx, child, &entries[i], offsets[i]);
+            skip = res == SFS_WALK_SKIP;
+            if (res && !skip) { free(child); return res; }
+        }
+
+        blockidx_t first_block = entries[i].first_block;
+        if (skip || !(entries[i].size & SFS_DIRECTORY) ||
+            first_block >= SFS_BLOCKTBL_NENTRIES ||
+            __atomic_exchange_n(&seen[first_block], 1, __ATOMIC_RELAXED)) {
+            free(child);
+            continue;
+        }
+
+        int res = queue(queue_ctx, child, first_block);
+        if (res) return res;
+    }
+    return 0;
+}
+
+struct level {
+    struct pending_dir *dirs;
+    size_t len, cap;
+};
+
+// queue a subdirectory for the next level of the serial walk
+static int queue_level(void *queue, char *path, blockidx_t first_block) {
+    struct level *next = queue;
+    if (next->len == next->cap) {
+        size_t cap = next->cap ? next->cap * 2 : 64;
+        struct pending_dir *grown = realloc(next->dirs, cap * sizeof(*grown));
+        if (!grown) { free(path); return -ENOMEM; }
+        next->dirs = grown;
+        next->cap = cap;
+    }
+    next->dirs[next->len].path = path;
+    next->dirs[next->len].first_block = first_block;
+    next->len++;
+    return 0;
+}
+
+static unsigned max_dir_entries(void) {
+    return SFS_ROOTDIR_NENTRIES > SFS_DIRREC_MAX ? SFS_ROOTDIR_NENTRIES : SFS_DIRREC_MAX;
+}
+
+int sfs_image_walk(struct sfs_image *img, const struct sfs_walk_ops *ops, void *ctx) {
+    uint8_t *seen = calloc(SFS_BLOCKTBL_NENTRIES, 1);
+    struct sfs_entry *entries = malloc(max_dir_entries() * sizeof(struct sfs_entry));
+    unsigned *offsets = malloc(max_dir_entries() * sizeof(unsigned));
+    struct level level = {0}, next = {0};
+    int res = (!seen || !entries || !offsets) ? -ENOMEM : 0;
+
+    if (res == 0) {
+        for (unsigned i = 0; i < SFS_ROOTDIR_NENTRIES; i++)
+            offsets[i] = SFS_ROOTDIR_OFF + i * (unsigned)sizeof(struct sfs_entry);
+        res = visit_dir(ops, ctx, "/", img->rootdir, offsets, SFS_ROOTDIR_NENTRIES, seen,
+                        queue_level, &next);
+    }
+
+    while (res == 0 && next.len > 0) {
+        // the queued level becomes current, sorted by position on disk
+        struct level tmp = level;
+        level = next;
+        next = tmp;
+        next.len = 0;
+        qsort(level.dirs, level.len, sizeof(*level.dirs), by_block);
+
+        for (size_t i = 0; i < level.len; i++) {
+            int n = res == 0 ? sfs_image_read_dir(img, level.dirs[i].first_block, entries,
+                                                  offsets)
+                             : 0;
+            if (n < 0) res = n;
+            if (res == 0)
+                res = visit_dir(ops, ctx, level.dirs[i].path, entries, offsets, (unsigned)n,
+                                seen, queue_level, &next);
+            free(level.dirs[i].path);
+        }
+        level.len = 0;
+    }
+
+    for (size_t i = 0; i < next.len; i++) free(next.dirs[i].path);
+    free(level.dirs);
+    free(next.dirs);
+    free(entries);
+    free(offsets);
+    free(seen);
+    return res;
+}
+
+int sfs_image_lookup(struct sfs_image *img, const char *path, struct sfs_entry *entry,
+                     unsigned *entry_off) {
+    if (strcmp(path, "/") == 0) {
+        memset(entry, 0, sizeof(*entry));
+        entry->size = SFS_DIRECTORY;
+        *entry_off = SFS_ROOTDIR_OFF;
+        return 0;
+    }
+
+    struct sfs_entry *entries = malloc(max_dir_entries() * sizeof(struct sfs_entry));
+    unsigned *offsets = malloc(max_dir_entries() * sizeof(unsigned));
+    if (!entries || !offsets) {
+        free(entries);
+        free(offsets);
+        return -ENOMEM;
+    }
+    memcpy(entries, img->rootdir, SFS_ROOTDIR_NENTRIES * sizeof(struct sfs_entry));
+    for (unsigned i = 0; i < SFS_ROOTDIR_NENTRIES; i++)
+        offsets[i] = SFS_ROOTDIR_OFF + i * (unsigned)sizeof(struct sfs_entry);
+    int n = SFS_ROOTDIR_NENTRIES;
+
+    int res = -ENOENT;
+    const char *component = path;
+    while (*component == '/') component++;
+    while (*component) {
+        size_t len = strcspn(component, "/");
+        int found = -1;
+        for (int i = 0; i < n && found < 0; i++) {
+            if (len < SFS_FILENAME_MAX && strncmp(entries[i].filename, component, len) == 0 &&
+                entries[i].filename[len] == '\0')
+                found = i;
+        }
+        if (found < 0) {
+            res = -ENOENT;
+            break;
+        }
+
+        const char *rest = component + len;
+        while (*rest == '/') rest++;
+        if (!*rest) {
+            *entry = entries[found];
+            *entry_off = offsets[found];
+            res = 0;
+            break;
+        }
+        if (!(entries[found].size & SFS_DIRECTORY)) {
+            res = -ENOTDIR;
+            break;
+        }
+        if (entries[found].first_block == SFS_BLOCKIDX_END) {
+            res = -ENOENT;
+            break;
+        }
+        n = sfs_image_read_dir(img, entries[found].first_block, entries, offsets);
+        if (n < 0) {
+            res = n;
+            break;
+        }
+        component = rest;
+    }
+
+    free(entries);
+    free(offsets);
+    return res;
+}
+
+// parallel walk: every directory is a task of its own
+struct pwalk {
+    struct sfs_image *img;
+    struct sfs_pool *pool;
+    const struct sfs_walk_ops *ops;
+    void *ctx;
+    uint8_t *seen;
+    int res;                    // first failure, ends the walk
+};
+
+struct pwalk_dir {
+    struct pwalk *walk;
+    char *path;
+    blockidx_t first_block;
+};
+
+static void pwalk_fail(struct pwalk *walk, int res) {
+    int ok = 0;
+    if (res) __atomic_compare_exchange_n(&walk->res, &ok, res, 0, __ATOMIC_RELAXED,
+                                         __ATOMIC_RELAXED);
+}
+
+static void pwalk_task(struct sfs_pool *pool, void *arg);
+
+static int queue_task(void *queue, char *path, blockidx_t first_block) {
+    struct pwalk *walk = queue;
+    struct pwalk_dir *dir = malloc(sizeof(*dir));
+    if (!dir) { free(path); return -ENOMEM; }
+    dir->walk = walk;
+    dir->path = path;
+    dir->first_block = first_block;
+    int res = sfs_pool_submit(walk->pool, pwalk_task, dir);
+    if (res < 0) {
+        free(path);
+        free(dir);
+    }
+    return res;
+}
+
+static void pwalk_task(struct sfs_pool *pool, void *arg) {
+    (void)pool;
+    struct pwalk_dir *dir = arg;
+    struct pwalk *walk = dir->walk;
+
+    if (__atomic_load_n(&walk->res, __ATOMIC_RELAXED) == 0) {
+        struct sfs_entry *entries = malloc(SFS_DIRREC_MAX * sizeof(struct sfs_entry));
+        unsigned *offsets = malloc(SFS_DIRREC_MAX * sizeof(unsigned));
+        int n = entries && offsets ? sfs_image_read_dir(walk->img, dir->first_block, entries,
+                                                        offsets)
+                                   : -ENOMEM;
+        int res = n < 0 ? n
+                        : visit_dir(walk->ops, walk->ctx, dir->path, entries, offsets,
+                                    (unsigned)n, walk->seen, queue_task, walk);
+        pwalk_fail(walk, res);
+        free(entries);
+        free(offsets);
+    }
+    free(dir->path);
+    free(dir);
+}
+
+int sfs_image_walk_parallel(struct sfs_image *img, struct sfs_pool *pool, const char *path,
+                            const struct sfs_walk_ops *ops, void *ctx) {
+    struct sfs_entry entry;
+    unsigned entry_off;
+    int res = sfs_image_lookup(img, path, &entry, &entry_off);
+    if (res < 0) return res;
+    if (!(entry.size & SFS_DIRECTORY)) return -ENOTDIR;
+
+    struct pwalk walk = { img, pool, ops, ctx, calloc(SFS_BLOCKTBL_NENTRIES, 1), 0 };
+    if (!walk.seen) return -ENOMEM;
+
+    if (strcmp(path, "/") == 0) {
+        unsigned *offsets = malloc(SFS_ROOTDIR_NENTRIES * sizeof(unsigned));
+        res = offsets ? 0 : -ENOMEM;
+        for (unsigned i = 0; res == 0 && i < SFS_ROOTDIR_NENTRIES; i++)
+            offsets[i] = SFS_ROOTDIR_OFF + i * (unsigned)sizeof(struct sfs_entry);
+        if (res == 0)
+            res = visit_dir(ops, ctx, "/", img->rootdir, offsets, SFS_ROOTDIR_NENTRIES,
+                            walk.seen, queue_task, &walk);
+        free(offsets);
+    } else if (entry.first_block < SFS_BLOCKTBL_NENTRIES) {
+        walk.seen[entry.first_block] = 1;
+        char *start = strdup(path);
+        res = start ? queue_task(&walk, start, entry.first_block) : -ENOMEM;
+    }
+    pwalk_fail(&walk, res);
+
+    sfs_pool_wait(pool);
+    free(walk.seen);
+    return walk.res;
+}
@@ -0,0 +1,82 @@
+/* Offline access to sfs images for the command line tools.
+   The root directory area and the block table are loaded with one
+   sequential read each; directory arrays are read on demand, in block
+   order, while walking the tree, or by the workers of a task pool, a
+   directory per task.
+*/
+
+#ifndef SFS_IMAGE_H
+#define SFS_IMAGE_H
+
+#include <stddef.h>
+#include <sys/types.h>
+#include "sfs.h"
+#include "sfs_format.h"
+
+struct sfs_pool;
+
+struct sfs_image {
+    int fd;
+    off_t size;                 // size of the image file in bytes
+    struct sfs_entry *rootdir;  // SFS_ROOTDIR_NENTRIES entries
+    blockidx_t *table;          // SFS_BLOCKTBL_NENTRIES entries
+    int has_super;              // super holds a valid superblock
+    struct sfs_super super;
+    blockidx_t *skiprefs;       // skip index references, with SFS_FEAT_SKIPIDX
+};
+
+// callbacks for sfs_image_walk, a non zero return stops the walk, except
+// SFS_WALK_SKIP from entry for a directory, which only keeps the walk out of it
+#define SFS_WALK_SKIP 1
+
+struct sfs_walk_ops {
+    // every directory once its entry array is loaded, the root included.
+    // directories that never held an entry have no blocks and no array,
+    // they only show up through entry with first_block SFS_BLOCKIDX_END
+    int (*dir)(void *ctx, const char *path, const struct sfs_entry *entries,
+               unsigned nentries);
+    // every named entry, files and directories alike
+    int (*entry)(void *ctx, const char *path, const struct sfs_entry *entry,
+                 unsigned entry_off);
+};
+
+// table holds the current copy of every page of a shadowed table; opened
+// writable, pages current in their shadow copy are written home first
+int sfs_image_open(struct sfs_image *img, const char *path, int writable);
+void sfs_image_close(struct sfs_image *img);
+
+// full pread/pwrite, -errno on failure
+int sfs_image_read(struct sfs_image *img, void *buf, size_t size, off_t offset);
+int sfs_image_write(struct sfs_image *img, const void *buf, size_t size, off_t offset);
+
+// blocks that are marked used but belong to no file: the one whose index is
+// the empty marker, and the superblock's reserved region
+int sfs_image_reserved(const struct sfs_image *img, blockidx_t block);
+
+// skip index block of the chain starting at head, SFS_BLOCKIDX_EMPTY if none
+blockidx_t sfs_image_skipidx(const struct sfs_image *img, blockidx_t head);
+
+// load the entry array of the directory starting at first_block, packed
+// records decoded into entries, with the offset of each on disk. entries and
+// offsets hold SFS_DIRREC_MAX; returns the number loaded or -errno
+int sfs_image_read_dir(struct sfs_image *img, blockidx_t first_block,
+                       struct sfs_entry *entries, unsigned *offsets);
+
+// breadth first walk over the whole tree, each level's directories read in
+// block order so the data region is crossed front to back once per level
+int sfs_image_walk(struct sfs_image *img, const struct sfs_walk_ops *ops, void *ctx);
+
+// resolve an absolute path like get_entry does on a mounted image: the entry
+// and its offset on disk, "/" giving a directory entry at SFS_ROOTDIR_OFF
+int sfs_image_lookup(struct sfs_image *img, const char *path, struct sfs_entry *entry,
+                     unsigned *entry_off);
+
+// walk the tree below the directory at path with the workers of pool, one
+// task per directory. the callbacks run on several threads at once and in
+// no particular order, except that a directory's entry is reported before
+// its own entries. the directory at path itself is not reported through
+// entry. returns the first failure or non zero callback result
+int sfs_image_walk_parallel(struct sfs_image *img, struct sfs_pool *pool, const char *path,
+                            const struct sfs_walk_ops *ops, void *ctx);
+
+#endif
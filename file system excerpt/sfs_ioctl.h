@@ -0,0 +1,38 @@
+/* ioctl interface of a mounted sfs image.
+   Shared between the file system and the command line tools that drive it.
+*/
+
+#ifndef SFS_IOCTL_H
+#define SFS_IOCTL_H
+
+#include <stdint.h>
+#include <sys/ioctl.h>
+
+#define SFS_IOC_MAGIC 'S'
+
+// relink part of a file's chain into contiguous blocks.
+// start is the chain position to resume at, 0 for a fresh pass over the file.
+// on return moved holds the blocks copied by this call and next the position
+// to pass as start for the following call, 0 once the file is done.
+struct sfs_defrag_req {
+    uint32_t start;
+    uint32_t max_blocks;
+    uint32_t moved;
+    uint32_t next;
+};
+
+#define SFS_IOC_DEFRAG _IOWR(SFS_IOC_MAGIC, 1, struct sfs_defrag_req)
+
+// delete the directory the ioctl is issued on and everything below it in one
+// call. on return the counts cover the directory itself and its contents;
+// blocks counts the chain blocks freed, skip index blocks included and pack
+// blocks emptied along the way not
+struct sfs_rmtree_req {
+    uint32_t files;
+    uint32_t dirs;
+    uint32_t blocks;
+};
+
+#define SFS_IOC_RMTREE _IOR(SFS_IOC_MAGIC, 2, struct sfs_rmtree_req)
+
+#endif
@@ -0,0 +1,228 @@
+/* sfs-mkfs: create an empty sfs image.
+   Only the metadata regions are written: the root directory area and the
+   block table, each built in memory and written in large sequential pieces.
+   Pieces that are all zero are skipped and the file is sized with ftruncate,
+   so the image starts out sparse and the data region is never touched; the
+   file system zeroes data blocks as it hands them out.
+
+   Format extensions (see sfs_format.h) put a superblock and their metadata
+   in reserved blocks at the end of the data region:
+     -l  persistent free list, so mounting needs no scan of the block table
+     -s  skip indexes, so seeking in long chains skips most table hops
+     -t  tail references, so appends go straight to the last block
+     -d  packed directories, variable length records instead of fixed entries
+     -p  small file packing, files below half a block share pack blocks
+     -c  copy on write table pages, so a crash leaves the last committed table;
+         not with -p, as packed files move between blocks without a commit
+
+   usage: sfs-mkfs [-l] [-s] [-t] [-d] [-p] [-c] image
+*/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "sfs.h"
+#include "sfs_format.h"
+
+// granularity of the zero check when writing metadata, one host page
+#define MKFS_CHUNK 4096
+
+static int write_all(int fd, const char *buf, size_t size, off_t offset) {
+    while (size > 0) {
+        ssize_t n = pwrite(fd, buf, size, offset);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) return -errno;
+        buf += n;
+        size -= (size_t)n;
+        offset += n;
+    }
+    return 0;
+}
+
+// write a region, leaving holes where it is all zero; the file was truncated
+// to nothing first, so holes already read back as zero
+static int write_sparse(int fd, const void *data, size_t size, off_t offset) {
+    const char *buf = data;
+    static const char zeros[MKFS_CHUNK];
+
+    size_t pos = 0;
+    while (pos < size) {
+        // gather neighbouring non zero chunks into one write
+        size_t start = pos;
+        while (pos < size) {
+            size_t n = size - pos < MKFS_CHUNK ? size - pos : MKFS_CHUNK;
+            if (memcmp(buf + pos, zeros, n) == 0) break;
+            pos += n;
+        }
+        if (pos > start) {
+            int res = write_all(fd, buf + start, pos - start, offset + (off_t)start);
+            if (res < 0) return res;
+        }
+        while (pos < size) {
+            size_t n = size - pos < MKFS_CHUNK ? size - pos : MKFS_CHUNK;
+            if (memcmp(buf + pos, zeros, n) != 0) break;
+            pos += n;
+        }
+    }
+    return 0;
+}
+
+// link all free blocks into one list in ascending order, the reserved blocks
+// are already marked in the table
+static void build_freelist(const blockidx_t *table, struct sfs_freelink *links,
+                           struct sfs_super *super) {
+    blockidx_t prev = SFS_BLOCKIDX_END;
+    super->free_head = SFS_BLOCKIDX_END;
+    for (unsigned i = 0; i < SFS_BLOCKTBL_NENTRIES; i++) {
+        links[i].prev = SFS_BLOCKIDX_END;
+        links[i].next = SFS_BLOCKIDX_END;
+        if (table[i] != SFS_BLOCKIDX_EMPTY) continue;
+
+        links[i].prev = prev;
+        if (prev == SFS_BLOCKIDX_END) super->free_head = i;
+        else links[prev].next = i;
+        prev = i;
+    }
+}
+
+int main(int argc, char **argv) {
+    int opt, freelist = 0, skipidx = 0, tailref = 0, packdir = 0, smallfile = 0, shadow = 0;
+    while ((opt = getopt(argc, argv, "lstdpc")) != -1) {
+        if (opt == 'l') {
+            freelist = 1;
+        } else if (opt == 's') {
+            skipidx = 1;
+        } else if (opt == 't') {
+            tailref = 1;
+        } else if (opt == 'd') {
+            packdir = 1;
+        } else if (opt == 'p') {
+            smallfile = 1;
+        } else if (opt == 'c') {
+            shadow = 1;
+        } else {
+            fprintf(stderr, "usage: %s [-l] [-s] [-t] [-d] [-p] [-c] image\n", argv[0]);
+            return 2;
+        }
+    }
+    if (optind + 1 != argc) {
+        fprintf(stderr, "usage: %s [-l] [-s] [-t] [-d] [-p] [-c] image\n", argv[0]);
+        return 2;
+    }
+    if (smallfile && shadow) {
+        fprintf(stderr, "sfs-mkfs: -p and -c cannot be combined\n");
+        return 2;
+    }
+    int extended = freelist || skipidx || tailref || packdir || smallfile || shadow;
+    const char *path = argv[optind];
+
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        fprintf(stderr, "sfs-mkfs: %s: %s\n", path, strerror(errno));
+        return 1;
+    }
+
+    off_t image_size = SFS_DATA_OFF + (off_t)SFS_BLOCKTBL_NENTRIES * SFS_BLOCK_SIZE;
+    struct sfs_entry *rootdir = calloc(SFS_ROOTDIR_NENTRIES, sizeof(struct sfs_entry));
+    blockidx_t *table = malloc(SFS_BLOCKTBL_NENTRIES * sizeof(blockidx_t));
+    struct sfs_freelink *links = NULL;
+    blockidx_t *skiprefs = NULL;
+    if (freelist) links = malloc(SFS_BLOCKTBL_NENTRIES * sizeof(struct sfs_freelink));
+    if (skipidx) skiprefs = malloc(SFS_BLOCKTBL_NENTRIES * sizeof(blockidx_t));
+    int res = (!rootdir || !table || (freelist && !links) || (skipidx && !skiprefs)) ? -ENOMEM : 0;
+
+    if (res == 0 && ftruncate(fd, image_size) < 0) res = -errno;
+
+    if (res == 0) {
+        for (unsigned i = 0; i < SFS_ROOTDIR_NENTRIES; i++)
+            rootdir[i].first_block = SFS_BLOCKIDX_EMPTY;
+        res = write_sparse(fd, rootdir, SFS_ROOTDIR_NENTRIES * sizeof(struct sfs_entry),
+                           SFS_ROOTDIR_OFF);
+    }
+
+    struct sfs_super super = {0};
+    if (res == 0) {
+        for (unsigned i = 0; i < SFS_BLOCKTBL_NENTRIES; i++) table[i] = SFS_BLOCKIDX_EMPTY;
+        // the block whose index doubles as the empty marker can never be
+        // handed out, keep it marked as used
+        if (SFS_BLOCKIDX_EMPTY < SFS_BLOCKTBL_NENTRIES) table[SFS_BLOCKIDX_EMPTY] = SFS_BLOCKIDX_END;
+
+        if (extended) {
+            // reserved regions back to back in front of the superblock
+            unsigned meta_start = SFS_SUPER_BLOCK;
+            // every page starts out current at home, the shadow copies are
+            // only read once a commit made them current
+            if (shadow) {
+                meta_start -= SFS_SHADOW_BLOCKS;
+                super.features |= SFS_FEAT_SHADOW;
+                super.shadow_start = meta_start;
+            }
+            // the tail references start out all zero, a count of zero
+            // meaning none, so their region is left as a hole
+            if (tailref) {
+                meta_start -= SFS_TAILREF_BLOCKS;
+                super.features |= SFS_FEAT_TAIL;
+                super.tailref_start = meta_start;
+            }
+            if (skipidx) {
+                meta_start -= SFS_SKIPREF_BLOCKS;
+                super.features |= SFS_FEAT_SKIPIDX;
+                super.skipref_start = meta_start;
+            }
+            if (freelist) {
+                meta_start -= SFS_FREELINK_BLOCKS;
+                super.features |= SFS_FEAT_FREELIST;
+                super.freelink_start = meta_start;
+            }
+            if (packdir) super.features |= SFS_FEAT_PACKDIR;
+            if (smallfile) super.features |= SFS_FEAT_SMALLFILE;
+            super.magic = SFS_SUPER_MAGIC;
+            super.version = SFS_SUPER_VERSION;
+            super.state = SFS_SUPER_CLEAN;
+            super.meta_start = meta_start;
+            super.entry_slots = SFS_ROOTDIR_NENTRIES;
+            for (unsigned i = super.meta_start; i <= SFS_SUPER_BLOCK; i++)
+                table[i] = SFS_BLOCKIDX_END;
+            for (unsigned i = 0; i < SFS_BLOCKTBL_NENTRIES; i++)
+                if (table[i] == SFS_BLOCKIDX_EMPTY) super.free_blocks++;
+            if (freelist) build_freelist(table, links, &super);
+            if (skipidx)
+                for (unsigned i = 0; i < SFS_BLOCKTBL_NENTRIES; i++)
+                    skiprefs[i] = SFS_BLOCKIDX_EMPTY;
+            super.checksum = sfs_super_checksum(&super);
+        }
+        res = write_sparse(fd, table, SFS_BLOCKTBL_NENTRIES * sizeof(blockidx_t),
+                           SFS_BLOCKTBL_OFF);
+    }
+
+    if (res == 0 && freelist)
+        res = write_sparse(fd, links, SFS_BLOCKTBL_NENTRIES * sizeof(struct sfs_freelink),
+                           SFS_DATA_OFF + (off_t)super.freelink_start * SFS_BLOCK_SIZE);
+    if (res == 0 && skipidx)
+        res = write_sparse(fd, skiprefs, SFS_BLOCKTBL_NENTRIES * sizeof(blockidx_t),
+                           SFS_DATA_OFF + (off_t)super.skipref_start * SFS_BLOCK_SIZE);
+    if (res == 0 && extended)
+        res = write_all(fd, (const char *)&super, sizeof(super),
+                        SFS_DATA_OFF + (off_t)SFS_SUPER_BLOCK * SFS_BLOCK_SIZE);
+
+    if (res == 0 && fsync(fd) < 0) res = -errno;
+    if (close(fd) < 0 && res == 0) res = -errno;
+    free(rootdir);
+    free(table);
+    free(links);
+    free(skiprefs);
+
+    if (res < 0) {
+        fprintf(stderr, "sfs-mkfs: %s: %s\n", path, strerror(-res));
+        return 1;
+    }
+    printf("%s: %u blocks of %u bytes, %lld bytes\n", path, (unsigned)SFS_BLOCKTBL_NENTRIES,
+           (unsigned)SFS_BLOCK_SIZE, (long long)image_size);
+    if (extended)
+        printf("%s: features %#x, %u blocks reserved\n", path, super.features,
+               (unsigned)(SFS_SUPER_BLOCK - super.meta_start + 1));
+    return 0;
+}
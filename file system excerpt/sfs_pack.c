@@ -0,0 +1,420 @@
+/* sfs-pack: build an sfs image from a directory tree on the host.
+   The tree is scanned first and laid out in memory: the files of a
+   directory are placed together, each in one contiguous run, followed by
+   the entry arrays of its subdirectories, then each subdirectory is laid
+   out the same way in turn. The root area
+   and block table are then written in large sequential pieces, holes left
+   where they are all zero, and the file data goes out in block order,
+   optionally read from the host by several threads at once.
+
+   Only regular files and directories are copied; anything else is skipped
+   with a warning. The image uses the plain format, sfs-mkfs extensions are
+   not set up.
+
+   usage: sfs-pack [-j threads] source image
+*/
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "sfs.h"
+
+// granularity of the zero check when writing metadata, one host page
+#define PACK_CHUNK 4096
+
+// bytes copied per read of a source file
+#define PACK_COPY (1u << 20)
+
+// blocks in the contiguous run that holds a directory's entry array
+#define DIR_BLOCKS \
+    ((SFS_DIR_NENTRIES * sizeof(struct sfs_entry) + SFS_BLOCK_SIZE - 1) / SFS_BLOCK_SIZE)
+
+struct node {
+    char name[SFS_FILENAME_MAX];
+    char *host;                 // path on the host
+    int is_dir;
+    off_t size;                 // bytes, files only
+    blockidx_t first_block;     // SFS_BLOCKIDX_END while it has no blocks
+    struct node *children;
+    unsigned nchildren;
+};
+
+struct packer {
+    int fd;
+    blockidx_t *table;
+    unsigned next_block;        // layout cursor
+    struct node **files;        // files with data, in block order
+    size_t nfiles, files_cap;
+    unsigned long dirs;
+
+    // shared by the copy threads
+    pthread_mutex_t lock;
+    size_t next_file;
+    int error;
+};
+
+static int write_all(int fd, const char *buf, size_t size, off_t offset) {
+    while (size > 0) {
+        ssize_t n = pwrite(fd, buf, size, offset);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) return -errno;
+        buf += n;
+        size -= (size_t)n;
+        offset += n;
+    }
+    return 0;
+}
+
+// write a region, leaving holes where it is all zero; the image was
+// truncated to nothing first, so holes already read back as zero
+static int write_sparse(int fd, const void *data, size_t size, off_t offset) {
+    const char *buf = data;
+    static const char zeros[PACK_CHUNK];
+
+    size_t pos = 0;
+    while (pos < size) {
+        // gather neighbouring non zero chunks into one write
+        size_t start = pos;
+        while (pos < size) {
+            size_t n = size - pos < PACK_CHUNK ? size - pos : PACK_CHUNK;
+            if (memcmp(buf + pos, zeros, n) == 0) break;
+            pos += n;
+        }
+        if (pos > start) {
+            int res = write_all(fd, buf + start, pos - start, offset + (off_t)start);
+            if (res < 0) return res;
+        }
+        while (pos < size) {
+            size_t n = size - pos < PACK_CHUNK ? size - pos : PACK_CHUNK;
+            if (memcmp(buf + pos, zeros, n) != 0) break;
+            pos += n;
+        }
+    }
+    return 0;
+}
+
+static int by_name(const void *a, const void *b) {
+    const struct node *x = a, *y = b;
+    return strcmp(x->name, y->name);
+}
+
+static char *join_path(const char *dir, const char *name) {
+    size_t len = strlen(dir) + strlen(name) + 2;
+    char *path = malloc(len);
+    if (path) snprintf(path, len, "%s/%s", dir, name);
+    return path;
+}
+
+static void free_tree(struct node *node) {
+    for (unsigned i = 0; i < node->nchildren; i++) free_tree(&node->children[i]);
+    free(node->children);
+    free(node->host);
+}
+
+// read a host directory into node, max_entries being what its array holds
+static int scan_dir(struct node *node, unsigned max_entries) {
+    DIR *dir = opendir(node->host);
+    if (!dir) {
+        fprintf(stderr, "sfs-pack: %s: %s\n", node->host, strerror(errno));
+        return -errno;
+    }
+
+    unsigned cap = 0;
+    int res = 0;
+    struct dirent *de;
+    while (res == 0 && (de = readdir(dir)) != NULL) {
+        if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0) continue;
+
+        char *host = join_path(node->host, de->d_name);
+        struct stat st;
+        if (!host) {
+            res = -ENOMEM;
+            break;
+        }
+        if (lstat(host, &st) < 0 || (!S_ISREG(st.st_mode) && !S_ISDIR(st.st_mode))) {
+            fprintf(stderr, "sfs-pack: skipping %s\n", host);
+            free(host);
+            continue;
+        }
+        if (strlen(de->d_name) >= SFS_FILENAME_MAX) {
+            fprintf(stderr, "sfs-pack: %s: name too long\n", host);
+            free(host);
+            res = -ENAMETOOLONG;
+            break;
+        }
+        if ((uint64_t)st.st_size > SFS_SIZEMASK) {
+            fprintf(stderr, "sfs-pack: %s: file too large\n", host);
+            free(host);
+            res = -EFBIG;
+            break;
+        }
+        if (node->nchildren == max_entries) {
+            fprintf(stderr, "sfs-pack: %s: more than %u entries\n", node->host, max_entries);
+            free(host);
+            res = -ENOSPC;
+            break;
+        }
+        if (node->nchildren == cap) {
+            cap = cap ? cap * 2 : 16;
+            if (cap > max_entries) cap = max_entries;
+            struct node *grown = realloc(node->children, cap * sizeof(*grown));
+            if (!grown) {
+                free(host);
+                res = -ENOMEM;
+                break;
+            }
+            node->children = grown;
+        }
+
+        struct node *child = &node->children[node->nchildren++];
+        memset(child, 0, sizeof(*child));
+        strcpy(child->name, de->d_name);
+        child->host = host;
+        child->is_dir = S_ISDIR(st.st_mode);
+        child->size = child->is_dir ? 0 : st.st_size;
+        child->first_block = SFS_BLOCKIDX_END;
+    }
+    closedir(dir);
+    if (res < 0) return res;
+
+    // the child array is complete, so pointers into it stay valid below
+    qsort(node->children, node->nchildren, sizeof(struct node), by_name);
+    for (unsigned i = 0; i < node->nchildren; i++) {
+        if (!node->children[i].is_dir) continue;
+        res = scan_dir(&node->children[i], SFS_DIR_NENTRIES);
+        if (res < 0) return res;
+    }
+    return 0;
+}
+
+// take the next len blocks as one chain, stepping over the block whose
+// index doubles as the empty marker
+static int take_run(struct packer *pk, unsigned len, blockidx_t *first) {
+    unsigned start = pk->next_block;
+    if (SFS_BLOCKIDX_EMPTY >= start && SFS_BLOCKIDX_EMPTY < start + len)
+        start = SFS_BLOCKIDX_EMPTY + 1;
+    if (start + len > SFS_BLOCKTBL_NENTRIES) return -ENOSPC;
+
+    for (unsigned i = 0; i + 1 < len; i++) pk->table[start + i] = start + i + 1;
+    pk->table[start + len - 1] = SFS_BLOCKIDX_END;
+    *first = start;
+    pk->next_block = start + len;
+    return 0;
+}
+
+// give the files in a directory their runs and its subdirectories their
+// arrays, then do the same below each subdirectory
+static int layout_dir(struct packer *pk, struct node *node) {
+    for (unsigned i = 0; i < node->nchildren; i++) {
+        struct node *child = &node->children[i];
+        if (child->is_dir || child->size == 0) continue;
+
+        unsigned blocks = (child->size + SFS_BLOCK_SIZE - 1) / SFS_BLOCK_SIZE;
+        int res = take_run(pk, blocks, &child->first_block);
+        if (res < 0) return res;
+
+        if (pk->nfiles == pk->files_cap) {
+            size_t cap = pk->files_cap ? pk->files_cap * 2 : 256;
+            struct node **grown = realloc(pk->files, cap * sizeof(*grown));
+            if (!grown) return -ENOMEM;
+            pk->files = grown;
+            pk->files_cap = cap;
+        }
+        pk->files[pk->nfiles++] = child;
+    }
+
+    // directories that hold no entries get no blocks, as on a live mount
+    for (unsigned i = 0; i < node->nchildren; i++) {
+        struct node *child = &node->children[i];
+        if (!child->is_dir) continue;
+        pk->dirs++;
+        if (child->nchildren == 0) continue;
+        int res = take_run(pk, DIR_BLOCKS, &child->first_block);
+        if (res < 0) return res;
+    }
+
+    for (unsigned i = 0; i < node->nchildren; i++) {
+        if (!node->children[i].is_dir) continue;
+        int res = layout_dir(pk, &node->children[i]);
+        if (res < 0) return res;
+    }
+    return 0;
+}
+
+// fill an entry array from a directory's children, free slots as mkfs and
+// the file system leave them
+static void fill_entries(const struct node *node, struct sfs_entry *entries, unsigned n) {
+    memset(entries, 0, n * sizeof(struct sfs_entry));
+    for (unsigned i = 0; i < n; i++) entries[i].first_block = SFS_BLOCKIDX_EMPTY;
+    for (unsigned i = 0; i < node->nchildren; i++) {
+        const struct node *child = &node->children[i];
+        // scan_dir only keeps names that fit with their terminator
+        memcpy(entries[i].filename, child->name, strlen(child->name));
+        entries[i].first_block = child->first_block;
+        entries[i].size = child->is_dir ? SFS_DIRECTORY : (uint32_t)child->size;
+    }
+}
+
+// write the entry arrays of all subdirectories below node
+static int write_dirs(struct packer *pk, const struct node *node) {
+    struct sfs_entry entries[SFS_DIR_NENTRIES];
+    for (unsigned i = 0; i < node->nchildren; i++) {
+        const struct node *child = &node->children[i];
+        if (!child->is_dir || child->first_block == SFS_BLOCKIDX_END) continue;
+        fill_entries(child, entries, SFS_DIR_NENTRIES);
+        int res = write_all(pk->fd, (const char *)entries, sizeof(entries),
+                            SFS_DATA_OFF + (off_t)child->first_block * SFS_BLOCK_SIZE);
+        if (res == 0) res = write_dirs(pk, child);
+        if (res < 0) return res;
+    }
+    return 0;
+}
+
+// copy one file into its run. the image is sparse where the copy does not
+// write, so the slack of the last block already reads as zero
+static int copy_file(struct packer *pk, const struct node *file, char *buf) {
+    int fd = open(file->host, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "sfs-pack: %s: %s\n", file->host, strerror(errno));
+        return -errno;
+    }
+
+    off_t dest = SFS_DATA_OFF + (off_t)file->first_block * SFS_BLOCK_SIZE;
+    off_t done = 0;
+    int res = 0;
+    while (res == 0 && done < file->size) {
+        size_t want = file->size - done < PACK_COPY ? (size_t)(file->size - done) : PACK_COPY;
+        ssize_t n = pread(fd, buf, want, done);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) {
+            res = -errno;
+        } else if (n == 0) {
+            // the file shrank since the scan, the rest stays zero
+            fprintf(stderr, "sfs-pack: %s: changed while packing\n", file->host);
+            break;
+        } else {
+            res = write_all(pk->fd, buf, (size_t)n, dest + done);
+            done += n;
+        }
+    }
+    if (res < 0) fprintf(stderr, "sfs-pack: %s: %s\n", file->host, strerror(-res));
+    close(fd);
+    return res;
+}
+
+// copy threads take files in block order, so the image is written close to
+// front to back even with several of them
+static void *copy_main(void *arg) {
+    struct packer *pk = arg;
+    char *buf = malloc(PACK_COPY);
+
+    for (;;) {
+        pthread_mutex_lock(&pk->lock);
+        size_t i = pk->next_file++;
+        int stop = pk->error || i >= pk->nfiles || !buf;
+        if (!buf && !pk->error) pk->error = -ENOMEM;
+        pthread_mutex_unlock(&pk->lock);
+        if (stop) break;
+
+        int res = copy_file(pk, pk->files[i], buf);
+        if (res < 0) {
+            pthread_mutex_lock(&pk->lock);
+            if (!pk->error) pk->error = res;
+            pthread_mutex_unlock(&pk->lock);
+        }
+    }
+    free(buf);
+    return NULL;
+}
+
+static int copy_files(struct packer *pk, unsigned threads) {
+    pthread_t *tids = calloc(threads, sizeof(pthread_t));
+    if (!tids) return -ENOMEM;
+
+    unsigned started = 0;
+    while (started < threads && pthread_create(&tids[started], NULL, copy_main, pk) == 0)
+        started++;
+    if (started == 0) copy_main(pk);
+    for (unsigned i = 0; i < started; i++) pthread_join(tids[i], NULL);
+    free(tids);
+    return pk->error;
+}
+
+static int pack(const char *source, const char *path, unsigned threads) {
+    struct node root = { .is_dir = 1, .first_block = SFS_BLOCKIDX_END };
+    struct packer pk = { .fd = -1, .next_block = 0 };
+    pthread_mutex_init(&pk.lock, NULL);
+
+    struct sfs_entry *rootdir = calloc(SFS_ROOTDIR_NENTRIES, sizeof(struct sfs_entry));
+    pk.table = malloc(SFS_BLOCKTBL_NENTRIES * sizeof(blockidx_t));
+    root.host = strdup(source);
+    int res = (!rootdir || !pk.table || !root.host) ? -ENOMEM : 0;
+
+    if (res == 0) res = scan_dir(&root, SFS_ROOTDIR_NENTRIES);
+    if (res == 0) {
+        for (unsigned i = 0; i < SFS_BLOCKTBL_NENTRIES; i++) pk.table[i] = SFS_BLOCKIDX_EMPTY;
+        if (SFS_BLOCKIDX_EMPTY < SFS_BLOCKTBL_NENTRIES) pk.table[SFS_BLOCKIDX_EMPTY] = SFS_BLOCKIDX_END;
+        res = layout_dir(&pk, &root);
+        if (res == -ENOSPC) fprintf(stderr, "sfs-pack: %s does not fit in an image\n", source);
+    }
+
+    if (res == 0) {
+        pk.fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (pk.fd < 0) res = -errno;
+    }
+    off_t image_size = SFS_DATA_OFF + (off_t)SFS_BLOCKTBL_NENTRIES * SFS_BLOCK_SIZE;
+    if (res == 0 && ftruncate(pk.fd, image_size) < 0) res = -errno;
+
+    // metadata first, front to back, then the data region in block order
+    if (res == 0) {
+        fill_entries(&root, rootdir, SFS_ROOTDIR_NENTRIES);
+        res = write_sparse(pk.fd, rootdir, SFS_ROOTDIR_NENTRIES * sizeof(struct sfs_entry),
+                           SFS_ROOTDIR_OFF);
+    }
+    if (res == 0)
+        res = write_sparse(pk.fd, pk.table, SFS_BLOCKTBL_NENTRIES * sizeof(blockidx_t),
+                           SFS_BLOCKTBL_OFF);
+    if (res == 0) res = write_dirs(&pk, &root);
+    if (res == 0) res = copy_files(&pk, threads);
+
+    if (res == 0 && fsync(pk.fd) < 0) res = -errno;
+    if (pk.fd >= 0 && close(pk.fd) < 0 && res == 0) res = -errno;
+
+    if (res == 0)
+        printf("%s: %zu files with data, %lu directories, %u of %u blocks used\n", path,
+               pk.nfiles, pk.dirs, pk.next_block, (unsigned)SFS_BLOCKTBL_NENTRIES);
+    else
+        fprintf(stderr, "sfs-pack: %s: %s\n", path, strerror(-res));
+
+    free_tree(&root);
+    free(rootdir);
+    free(pk.table);
+    free(pk.files);
+    pthread_mutex_destroy(&pk.lock);
+    return res;
+}
+
+int main(int argc, char **argv) {
+    int opt;
+    unsigned threads = 1;
+    while ((opt = getopt(argc, argv, "j:")) != -1) {
+        if (opt == 'j' && atoi(optarg) > 0) {
+            threads = (unsigned)atoi(optarg);
+        } else {
+            fprintf(stderr, "usage: %s [-j threads] source image\n", argv[0]);
+            return 2;
+        }
+    }
+    if (optind + 2 != argc) {
+        fprintf(stderr, "usage: %s [-j threads] source image\n", argv[0]);
+        return 2;
+    }
+
+    return pack(argv[optind], argv[optind + 1], threads) < 0 ? 1 : 0;
+}
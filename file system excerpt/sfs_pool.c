@@ -0,0 +1,222 @@
+/* Work stealing task pool, see sfs_pool.h */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "sfs_pool.h"
+
+struct pool_task {
+    sfs_task_fn fn;
+    void *arg;
+};
+
+// a ring of tasks; the owner pushes and pops at the back, thieves take from
+// the front. tasks are a directory each, so a lock per deque is cheap enough
+struct pool_deque {
+    pthread_mutex_t lock;
+    struct pool_task *tasks;
+    size_t front, len, cap;
+};
+
+struct sfs_pool {
+    unsigned nthreads;
+    pthread_t *threads;
+    struct pool_deque *deques;
+    unsigned next_deque;        // where the next outside submission goes
+
+    // guards the counts below; workers with nothing to steal sleep on work
+    pthread_mutex_t lock;
+    pthread_cond_t work, done;
+    unsigned long queued;       // tasks sitting in a deque
+    unsigned long pending;      // tasks submitted and not finished
+    unsigned sleeping;
+    int stopping;
+};
+
+struct worker_start {
+    struct sfs_pool *pool;
+    unsigned id;
+};
+
+// the pool and deque of the calling thread, when it is a worker
+static __thread struct sfs_pool *self_pool;
+static __thread unsigned self_id;
+
+static int deque_push(struct pool_deque *dq, struct pool_task task) {
+    pthread_mutex_lock(&dq->lock);
+    if (dq->len == dq->cap) {
+        size_t cap = dq->cap ? dq->cap * 2 : 64;
+        struct pool_task *grown = malloc(cap * sizeof(*grown));
+        if (!grown) {
+            pthread_mutex_unlock(&dq->lock);
+            return -ENOMEM;
+        }
+        for (size_t i = 0; i < dq->len; i++) grown[i] = dq->tasks[(dq->front + i) % dq->cap];
+        free(dq->tasks);
+        dq->tasks = grown;
+        dq->cap = cap;
+        dq->front = 0;
+    }
+    dq->tasks[(dq->front + dq->len) % dq->cap] = task;
+    dq->len++;
+    pthread_mutex_unlock(&dq->lock);
+    return 0;
+}
+
+// take a task from the back, or the front when stealing. 0 when empty
+static int deque_take(struct pool_deque *dq, int steal, struct pool_task *task) {
+    pthread_mutex_lock(&dq->lock);
+    int found = dq->len > 0;
+    if (found && steal) {
+        *task = dq->tasks[dq->front];
+        dq->front = (dq->front + 1) % dq->cap;
+        dq->len--;
+    } else if (found) {
+        *task = dq->tasks[(dq->front + dq->len - 1) % dq->cap];
+        dq->len--;
+    }
+    pthread_mutex_unlock(&dq->lock);
+    return found;
+}
+
+// own deque first, then the others in turn starting after our own
+static int find_task(struct sfs_pool *pool, unsigned id, struct pool_task *task) {
+    if (deque_take(&pool->deques[id], 0, task)) return 1;
+    for (unsigned i = 1; i < pool->nthreads; i++)
+        if (deque_take(&pool->deques[(id + i) % pool->nthreads], 1, task)) return 1;
+    return 0;
+}
+
+static void *worker_main(void *arg) {
+    struct worker_start *start = arg;
+    struct sfs_pool *pool = start->pool;
+    unsigned id = start->id;
+    free(start);
+    self_pool = pool;
+    self_id = id;
+
+    for (;;) {
+        struct pool_task task;
+        if (find_task(pool, id, &task)) {
+            pthread_mutex_lock(&pool->lock);
+            pool->queued--;
+            pthread_mutex_unlock(&pool->lock);
+
+            task.fn(pool, task.arg);
+
+            pthread_mutex_lock(&pool->lock);
+            if (--pool->pending == 0) pthread_cond_broadcast(&pool->done);
+            pthread_mutex_unlock(&pool->lock);
+            continue;
+        }
+
+        // nothing to steal: sleep until a submission or shutdown. queued is
+        // raised before a submitter signals, so a wakeup cannot be missed
+        pthread_mutex_lock(&pool->lock);
+        while (pool->queued == 0 && !pool->stopping) {
+            pool->sleeping++;
+            pthread_cond_wait(&pool->work, &pool->lock);
+            pool->sleeping--;
+        }
+        int stop = pool->stopping && pool->queued == 0;
+        pthread_mutex_unlock(&pool->lock);
+        if (stop) return NULL;
+    }
+}
+
+int sfs_pool_submit(struct sfs_pool *pool, sfs_task_fn fn, void *arg) {
+    // counted before it is visible, so a fast worker cannot finish it first
+    pthread_mutex_lock(&pool->lock);
+    unsigned id = self_pool == pool ? self_id : pool->next_deque++ % pool->nthreads;
+    pool->pending++;
+    pthread_mutex_unlock(&pool->lock);
+
+    struct pool_task task = { fn, arg };
+    int res = deque_push(&pool->deques[id], task);
+
+    pthread_mutex_lock(&pool->lock);
+    if (res < 0) {
+        if (--pool->pending == 0) pthread_cond_broadcast(&pool->done);
+    } else {
+        pool->queued++;
+        if (pool->sleeping > 0) pthread_cond_signal(&pool->work);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return res;
+}
+
+void sfs_pool_wait(struct sfs_pool *pool) {
+    pthread_mutex_lock(&pool->lock);
+    while (pool->pending > 0) pthread_cond_wait(&pool->done, &pool->lock);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+unsigned sfs_pool_threads(const struct sfs_pool *pool) {
+    return pool->nthreads;
+}
+
+static void free_pool(struct sfs_pool *pool) {
+    for (unsigned i = 0; i < pool->nthreads; i++) {
+        pthread_mutex_destroy(&pool->deques[i].lock);
+        free(pool->deques[i].tasks);
+    }
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->work);
+    pthread_cond_destroy(&pool->done);
+    free(pool->deques);
+    free(pool->threads);
+    free(pool);
+}
+
+// stop and join the first started workers
+static void stop_workers(struct sfs_pool *pool, unsigned started) {
+    pthread_mutex_lock(&pool->lock);
+    pool->stopping = 1;
+    pthread_cond_broadcast(&pool->work);
+    pthread_mutex_unlock(&pool->lock);
+    for (unsigned i = 0; i < started; i++) pthread_join(pool->threads[i], NULL);
+}
+
+struct sfs_pool *sfs_pool_create(unsigned nthreads) {
+    if (nthreads == 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        nthreads = cpus > 0 ? (unsigned)cpus : 1;
+    }
+
+    struct sfs_pool *pool = calloc(1, sizeof(*pool));
+    if (!pool) return NULL;
+    pool->nthreads = nthreads;
+    pool->threads = calloc(nthreads, sizeof(pthread_t));
+    pool->deques = calloc(nthreads, sizeof(struct pool_deque));
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->work, NULL);
+    pthread_cond_init(&pool->done, NULL);
+    if (!pool->threads || !pool->deques) {
+        pool->nthreads = 0;
+        free_pool(pool);
+        return NULL;
+    }
+    for (unsigned i = 0; i < nthreads; i++) pthread_mutex_init(&pool->deques[i].lock, NULL);
+
+    for (unsigned i = 0; i < nthreads; i++) {
+        struct worker_start *start = malloc(sizeof(*start));
+        if (start) {
+            start->pool = pool;
+            start->id = i;
+        }
+        if (!start || pthread_create(&pool->threads[i], NULL, worker_main, start) != 0) {
+            free(start);
+            stop_workers(pool, i);
+            free_pool(pool);
+            return NULL;
+        }
+    }
+    return pool;
+}
+
+void sfs_pool_destroy(struct sfs_pool *pool) {
+    sfs_pool_wait(pool);
+    stop_workers(pool, pool->nthreads);
+    free_pool(pool);
+}
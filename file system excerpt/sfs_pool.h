@@ -0,0 +1,32 @@
+/* Work stealing task pool for the command line tools.
+   Every worker owns a deque: tasks a worker submits go to the back of its
+   own deque and it takes work from the back, so a tree walk runs depth
+   first per worker and stays in cache. An idle worker steals from the front
+   of another worker's deque, which holds the oldest tasks, the tops of
+   unexplored subtrees. Tasks submitted from outside the pool are spread
+   over the deques.
+*/
+
+#ifndef SFS_POOL_H
+#define SFS_POOL_H
+
+struct sfs_pool;
+
+typedef void (*sfs_task_fn)(struct sfs_pool *pool, void *arg);
+
+// start a pool of nthreads workers, 0 for one per online CPU. NULL on failure
+struct sfs_pool *sfs_pool_create(unsigned nthreads);
+
+unsigned sfs_pool_threads(const struct sfs_pool *pool);
+
+// queue fn(pool, arg). tasks may submit further tasks. returns -errno
+int sfs_pool_submit(struct sfs_pool *pool, sfs_task_fn fn, void *arg);
+
+// wait until every submitted task, and every task those submitted, has
+// finished. called from outside the pool
+void sfs_pool_wait(struct sfs_pool *pool);
+
+// wait for outstanding tasks and stop the workers
+void sfs_pool_destroy(struct sfs_pool *pool);
+
+#endif
@@ -0,0 +1,262 @@
+/* sfs-rm: remove a file or a whole directory tree from an unmounted image.
+   The tree below the path is walked by a pool of threads, one task per
+   directory, and every chain is freed in the in memory block table. Pack
+   blocks are released once the walk is done and the entry is cleared in its
+   parent, then the table goes back to the image in one write.
+
+   Images with a superblock are marked dirty first, so the next mount
+   rebuilds the free list and the counters from the table. Tail references
+   of freed chains are cleared, as the file system does when it frees one.
+
+   usage: sfs-rm [-j threads] image path
+*/
+
+#include <errno.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "sfs_image.h"
+#include "sfs_pool.h"
+
+struct packed_file {
+    blockidx_t block;
+    unsigned off, len;
+};
+
+struct remover {
+    struct sfs_image *img;
+    unsigned long files, dirs, blocks;
+    struct sfs_tailref *tailrefs; // with SFS_FEAT_TAIL
+
+    // packed files, released after the walk as they share pack blocks
+    pthread_mutex_t lock;
+    struct packed_file *packed;
+    size_t npacked, packed_cap;
+};
+
+static int is_packed_file(const struct sfs_image *img, const struct sfs_entry *entry) {
+    return img->has_super && (img->super.features & SFS_FEAT_SMALLFILE) &&
+           !(entry->size & SFS_DIRECTORY) && (entry->size & SFS_PACKED);
+}
+
+// mark a chain free in the in memory table. chains never share blocks, so
+// parallel callers touch disjoint table entries; a damaged chain stops at
+// the first block that is already free, out of range or reserved
+static unsigned long free_chain(struct sfs_image *img, blockidx_t block) {
+    unsigned long n = 0;
+    while (block < SFS_BLOCKTBL_NENTRIES && !sfs_image_reserved(img, block) &&
+           img->table[block] != SFS_BLOCKIDX_EMPTY && n < SFS_BLOCKTBL_NENTRIES) {
+        blockidx_t next = img->table[block];
+        img->table[block] = SFS_BLOCKIDX_EMPTY;
+        block = next;
+        n++;
+    }
+    return n;
+}
+
+static int remember_packed(struct remover *rm, const struct sfs_entry *entry) {
+    pthread_mutex_lock(&rm->lock);
+    if (rm->npacked == rm->packed_cap) {
+        size_t cap = rm->packed_cap ? rm->packed_cap * 2 : 64;
+        struct packed_file *grown = realloc(rm->packed, cap * sizeof(*grown));
+        if (!grown) {
+            pthread_mutex_unlock(&rm->lock);
+            return -ENOMEM;
+        }
+        rm->packed = grown;
+        rm->packed_cap = cap;
+    }
+    struct packed_file *file = &rm->packed[rm->npacked++];
+    file->block = entry->first_block;
+    file->off = SFS_PACK_OFF(entry->size);
+    file->len = SFS_PACK_LEN(entry->size);
+    pthread_mutex_unlock(&rm->lock);
+    return 0;
+}
+
+// free everything an entry owns: a directory's entry array, a file's chain,
+// skip index block and tail reference. the array is only marked free in the
+// table, the walk still reads it from the image afterwards
+static int remove_entry(struct remover *rm, const struct sfs_entry *entry) {
+    struct sfs_image *img = rm->img;
+    unsigned long blocks = 0;
+
+    if (is_packed_file(img, entry)) {
+        int res = remember_packed(rm, entry);
+        if (res < 0) return res;
+    } else if (entry->first_block != SFS_BLOCKIDX_END) {
+        blockidx_t idx = sfs_image_skipidx(img, entry->first_block);
+        if (idx != SFS_BLOCKIDX_EMPTY && idx < SFS_BLOCKTBL_NENTRIES) {
+            blocks += free_chain(img, idx);
+            img->skiprefs[entry->first_block] = SFS_BLOCKIDX_EMPTY;
+        }
+        if (rm->tailrefs && entry->first_block < SFS_BLOCKTBL_NENTRIES)
+            rm->tailrefs[entry->first_block].count = 0;
+        blocks += free_chain(img, entry->first_block);
+    }
+
+    pthread_mutex_lock(&rm->lock);
+    if (entry->size & SFS_DIRECTORY) rm->dirs++;
+    else rm->files++;
+    rm->blocks += blocks;
+    pthread_mutex_unlock(&rm->lock);
+    return 0;
+}
+
+static int on_entry(void *ctx, const char *path, const struct sfs_entry *entry,
+                    unsigned entry_off) {
+    (void)path;
+    (void)entry_off;
+    return remove_entry(ctx, entry);
+}
+
+static int by_block(const void *a, const void *b) {
+    const struct packed_file *x = a, *y = b;
+    return (int)x->block - (int)y->block;
+}
+
+// clear the fragments of the removed packed files, each pack block's map
+// read and written once. a pack block left with only its map is freed
+static int release_packed(struct remover *rm) {
+    struct sfs_image *img = rm->img;
+    if (rm->npacked > 0) qsort(rm->packed, rm->npacked, sizeof(*rm->packed), by_block);
+
+    for (size_t i = 0; i < rm->npacked;) {
+        blockidx_t block = rm->packed[i].block;
+        size_t end = i;
+        while (end < rm->npacked && rm->packed[end].block == block) end++;
+        if (block >= SFS_BLOCKTBL_NENTRIES || img->table[block] != SFS_BLOCKIDX_END) {
+            i = end;
+            continue;
+        }
+
+        off_t map_off = SFS_DATA_OFF + (off_t)block * SFS_BLOCK_SIZE;
+        struct sfs_packmap map;
+        int res = sfs_image_read(img, &map, sizeof(map), map_off);
+        if (res < 0) return res;
+        for (; i < end; i++) {
+            unsigned first = rm->packed[i].off / SFS_PACK_FRAG;
+            unsigned n = (rm->packed[i].len + SFS_PACK_FRAG - 1) / SFS_PACK_FRAG;
+            for (unsigned f = first; f < first + n && f < SFS_PACK_FRAGS; f++)
+                map.used[f / 32] &= ~(1u << (f % 32));
+        }
+
+        int used = 0;
+        for (unsigned f = 1; f < SFS_PACK_FRAGS && !used; f++)
+            used = (map.used[f / 32] >> (f % 32)) & 1;
+        if (used) {
+            res = sfs_image_write(img, &map, sizeof(map), map_off);
+            if (res < 0) return res;
+        } else {
+            img->table[block] = SFS_BLOCKIDX_EMPTY;
+            rm->blocks++;
+        }
+    }
+    return 0;
+}
+
+// free the slot or record at entry_off, as clear_entry does when mounted
+static int clear_entry(struct sfs_image *img, unsigned entry_off) {
+    if (entry_off >= SFS_DATA_OFF && img->has_super &&
+        (img->super.features & SFS_FEAT_PACKDIR)) {
+        uint8_t name_len = 0;
+        return sfs_image_write(img, &name_len, sizeof(name_len),
+                               entry_off + offsetof(struct sfs_dirrec, name_len));
+    }
+    struct sfs_entry empty = {0};
+    empty.first_block = SFS_BLOCKIDX_EMPTY;
+    return sfs_image_write(img, &empty, sizeof(empty), entry_off);
+}
+
+static int remove_path(struct sfs_image *img, const char *path, unsigned threads) {
+    struct sfs_entry entry;
+    unsigned entry_off;
+    int res = sfs_image_lookup(img, path, &entry, &entry_off);
+    if (res < 0) return res;
+    if (strcmp(path, "/") == 0) return -EBUSY;
+
+    // the next mount must not trust the saved free list and counters
+    if (img->has_super) {
+        img->super.state = SFS_SUPER_DIRTY;
+        img->super.checksum = sfs_super_checksum(&img->super);
+        res = sfs_image_write(img, &img->super, sizeof(img->super),
+                              SFS_DATA_OFF + (off_t)SFS_SUPER_BLOCK * SFS_BLOCK_SIZE);
+        if (res < 0) return res;
+    }
+
+    struct remover rm = { .img = img };
+    if (img->has_super && (img->super.features & SFS_FEAT_TAIL)) {
+        rm.tailrefs = malloc(SFS_BLOCKTBL_NENTRIES * sizeof(struct sfs_tailref));
+        if (!rm.tailrefs) return -ENOMEM;
+        res = sfs_image_read(img, rm.tailrefs, SFS_BLOCKTBL_NENTRIES * sizeof(struct sfs_tailref),
+                             SFS_DATA_OFF + (off_t)img->super.tailref_start * SFS_BLOCK_SIZE);
+        if (res < 0) {
+            free(rm.tailrefs);
+            return res;
+        }
+    }
+    pthread_mutex_init(&rm.lock, NULL);
+
+    if ((entry.size & SFS_DIRECTORY) && entry.first_block != SFS_BLOCKIDX_END) {
+        struct sfs_pool *pool = sfs_pool_create(threads);
+        struct sfs_walk_ops ops = { .entry = on_entry };
+        res = pool ? sfs_image_walk_parallel(img, pool, path, &ops, &rm) : -ENOMEM;
+        if (pool) sfs_pool_destroy(pool);
+    }
+    if (res == 0) res = remove_entry(&rm, &entry);
+
+    // the entry goes first, as with SFS_IOC_RMTREE: a crash before the pack
+    // maps, table, skip and tail references are written only leaks the
+    // blocks, which sfs-fsck gives back
+    if (res == 0) res = clear_entry(img, entry_off);
+    if (res == 0) res = release_packed(&rm);
+    if (res == 0)
+        res = sfs_image_write(img, img->table, SFS_BLOCKTBL_NENTRIES * sizeof(blockidx_t),
+                              SFS_BLOCKTBL_OFF);
+    if (res == 0 && img->skiprefs)
+        res = sfs_image_write(img, img->skiprefs, SFS_BLOCKTBL_NENTRIES * sizeof(blockidx_t),
+                              SFS_DATA_OFF + (off_t)img->super.skipref_start * SFS_BLOCK_SIZE);
+    if (res == 0 && rm.tailrefs)
+        res = sfs_image_write(img, rm.tailrefs, SFS_BLOCKTBL_NENTRIES * sizeof(struct sfs_tailref),
+                              SFS_DATA_OFF + (off_t)img->super.tailref_start * SFS_BLOCK_SIZE);
+
+    if (res == 0)
+        fprintf(stderr, "%s: removed %lu files, %lu directories, %lu blocks\n", path,
+                rm.files, rm.dirs, rm.blocks);
+    pthread_mutex_destroy(&rm.lock);
+    free(rm.packed);
+    free(rm.tailrefs);
+    return res;
+}
+
+int main(int argc, char **argv) {
+    int opt;
+    unsigned threads = 1;
+    while ((opt = getopt(argc, argv, "j:")) != -1) {
+        if (opt == 'j') {
+            threads = (unsigned)atoi(optarg);
+        } else {
+            fprintf(stderr, "usage: %s [-j threads] image path\n", argv[0]);
+            return 2;
+        }
+    }
+    if (optind + 2 != argc) {
+        fprintf(stderr, "usage: %s [-j threads] image path\n", argv[0]);
+        return 2;
+    }
+
+    struct sfs_image img;
+    int res = sfs_image_open(&img, argv[optind], 1);
+    if (res < 0) {
+        fprintf(stderr, "sfs-rm: %s: %s\n", argv[optind], strerror(-res));
+        return 1;
+    }
+    res = remove_path(&img, argv[optind + 1], threads);
+    if (res < 0) fprintf(stderr, "sfs-rm: %s: %s\n", argv[optind + 1], strerror(-res));
+    sfs_image_close(&img);
+    return res < 0 ? 1 : 0;
+}
@@ -0,0 +1,37 @@
+/* sfs-rmtree: delete directory trees on a mounted sfs image.
+   Each directory is removed with everything below it by one SFS_IOC_RMTREE
+   call, which the file system carries out in process, instead of an unlink
+   or rmdir per entry.
+
+   usage: sfs-rmtree directory...
+*/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include "sfs_ioctl.h"
+
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s directory...\n", argv[0]);
+        return 2;
+    }
+
+    int failed = 0;
+    for (int i = 1; i < argc; i++) {
+        int fd = open(argv[i], O_RDONLY | O_DIRECTORY);
+        struct sfs_rmtree_req req;
+        memset(&req, 0, sizeof(req));
+        if (fd < 0 || ioctl(fd, SFS_IOC_RMTREE, &req) < 0) {
+            fprintf(stderr, "sfs-rmtree: %s: %s\n", argv[i], strerror(errno));
+            failed = 1;
+        } else {
+            printf("%s: %u files, %u directories, %u blocks freed\n", argv[i], req.files,
+                   req.dirs, req.blocks);
+        }
+        if (fd >= 0) close(fd);
+    }
+    return failed;
+}